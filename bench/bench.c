@@ -0,0 +1,594 @@
+/*
+ * Single threaded workloads over the storage engines, key types and key distributions.
+ * Prints one CSV row per workload: engine,key,dist,size,op,ns_per_op,allocs,peak_bytes,peak_rss_kb
+ * allocs and peak_bytes count the map's own allocations during the workload, peak_rss_kb is
+ * the peak resident size of the whole process so far. For iterate, copy and equal an op is
+ * one entry of the map.
+ * With -b, rows of an earlier run's output are matched by their first five columns and the
+ * baseline time and the change in percent are appended, so two builds can be diffed:
+ *   ./old/cmap_bench > old.csv && ./new/cmap_bench -b old.csv
+ * Usage: cmap_bench [-s sizes] [-k keys] [-d dists] [-e engines] [-b baseline.csv]
+ * Lists are comma separated, sizes may use exponents (1e7).
+ */
+#define _XOPEN_SOURCE 600
+
+#include <cmap.h>
+#include <math.h>   /* pow */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h> /* getrusage */
+#include <time.h>         /* clock_gettime */
+#define BENCH_POSIX
+#else
+#include <time.h> /* clock */
+#endif
+
+/* Keys are prepared and timed in chunks of this many, outside of the timed part */
+#define CHUNK 4096
+
+enum { DIST_SEQ, DIST_UNIFORM, DIST_ZIPF, NDISTS };
+enum { ENGINE_CHAINED, ENGINE_FLAT, ENGINE_DENSE, ENGINE_POOL, ENGINE_INCREMENTAL, NENGINES };
+enum { OP_INSERT, OP_HIT, OP_MISS, OP_ITERATE, OP_COPY, OP_EQUAL, OP_REMOVE, NOPS };
+
+static const char *dist_names[NDISTS] = {"sequential", "uniform", "zipfian"};
+static const char *engine_names[NENGINES] = {"chained", "flat", "dense", "pool", "incremental"};
+static const char *op_names[NOPS] = {"insert", "hit", "miss", "iterate", "copy", "equal", "remove"};
+
+/* Counting allocator, blocks carry their size so the peak of live bytes is known */
+typedef union {
+    size_t size;
+    double d;
+    void *p;
+    long l;
+} header_t;
+
+static size_t nallocs, live_bytes, peak_bytes;
+
+static void *count_alloc(void *udata, size_t size) {
+    header_t *h = (header_t *) malloc(sizeof(header_t) + size);
+    (void) udata;
+    if (h == NULL) {
+        return NULL;
+    }
+    h->size = size;
+    nallocs++;
+    if ((live_bytes += size) > peak_bytes) {
+        peak_bytes = live_bytes;
+    }
+    return h + 1;
+}
+
+static void count_free(void *udata, void *ptr) {
+    (void) udata;
+    if (ptr != NULL) {
+        live_bytes -= ((header_t *) ptr - 1)->size;
+        free((header_t *) ptr - 1);
+    }
+}
+
+static void *count_realloc(void *udata, void *ptr, size_t size) {
+    header_t *h;
+    size_t old;
+    if (ptr == NULL) {
+        return count_alloc(udata, size);
+    }
+    old = ((header_t *) ptr - 1)->size;
+    if ((h = (header_t *) realloc((header_t *) ptr - 1, sizeof(header_t) + size)) == NULL) {
+        return NULL;
+    }
+    h->size = size;
+    nallocs++;
+    if ((live_bytes += size - old) > peak_bytes && size > old) {
+        peak_bytes = live_bytes;
+    }
+    return h + 1;
+}
+
+static map_allocator_t counting = {count_alloc, count_realloc, count_free, NULL};
+
+static double now(void) {
+#ifdef BENCH_POSIX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static long peak_rss_kb(void) {
+#ifdef BENCH_POSIX
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+        return ru.ru_maxrss / 1024;
+#else
+        return ru.ru_maxrss;
+#endif
+    }
+#endif
+    return -1;
+}
+
+/* Bijective on 32 bits, so distinct ids stay distinct keys */
+static unsigned long scramble(unsigned long x) {
+    x &= 0xffffffffUL;
+    x ^= x >> 16;
+    x = (x * 0x85ebca6bUL) & 0xffffffffUL;
+    x ^= x >> 13;
+    x = (x * 0xc2b2ae35UL) & 0xffffffffUL;
+    x ^= x >> 16;
+    return x;
+}
+
+static unsigned long xorshift(unsigned long *s) {
+    *s ^= (*s << 13) & 0xffffffffUL;
+    *s ^= *s >> 17;
+    *s ^= (*s << 5) & 0xffffffffUL;
+    return *s;
+}
+
+/* Zipfian ranks with theta 0.99 over [0, n), as in Gray et al., "Quickly generating billion-record synthetic databases" */
+typedef struct {
+    double n, theta, alpha, zetan, eta;
+} zipf_t;
+
+static void zipf_init(zipf_t *z, size_t n) {
+    double zeta2 = 1 + pow(0.5, 0.99);
+    size_t i;
+    z->n = (double) n;
+    z->theta = 0.99;
+    z->alpha = 1 / (1 - z->theta);
+    for (z->zetan = 0, i = 1; i <= n; i++) {
+        z->zetan += 1 / pow((double) i, z->theta);
+    }
+    z->eta = (1 - pow(2 / z->n, 1 - z->theta)) / (1 - zeta2 / z->zetan);
+}
+
+static size_t zipf_next(const zipf_t *z, unsigned long *rng) {
+    double u = (double) (xorshift(rng) & 0xffffffUL) / 16777216.0, uz = u * z->zetan;
+    size_t r;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    r = (size_t) (z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return (r < (size_t) z->n) ? r : (size_t) z->n - 1;
+}
+
+/* One benchmark run: its map has n keys with ids [0, n), misses use ids [n, 2n) */
+typedef struct {
+    int engine, dist;
+    size_t n;
+    unsigned long rng;
+    zipf_t zipf;
+    size_t stride, pos;
+    /* string keys of the ids [0, n), STRLEN bytes each */
+    char *strpool;
+} run_t;
+
+#define STRLEN 12
+
+static unsigned long key_value(const run_t *r, size_t id) {
+    return (r->dist == DIST_SEQ) ? (unsigned long) id : scramble((unsigned long) id);
+}
+
+/* Ids of the i-th lookup: in order for sequential keys, drawn at random otherwise */
+static size_t lookup_id(run_t *r, size_t i) {
+    switch (r->dist) {
+        case DIST_UNIFORM:
+            return (size_t) (xorshift(&r->rng) % r->n);
+        case DIST_ZIPF:
+            return zipf_next(&r->zipf, &r->rng);
+        default:
+            return i;
+    }
+}
+
+static size_t gcd(size_t a, size_t b) {
+    size_t t;
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Ids of the removals, called for i = 0, 1, ...: every id once, scattered unless keys are sequential */
+static size_t remove_id(run_t *r, size_t i) {
+    if (r->dist == DIST_SEQ) {
+        return i;
+    }
+    if (i == 0) {
+        /* A stride coprime to n visits every id */
+        for (r->stride = r->n / 2 + r->n / 8 + 1; gcd(r->stride, r->n) != 1; r->stride++) {
+        }
+        r->pos = 0;
+    } else if ((r->pos += r->stride) >= r->n) {
+        r->pos -= r->n;
+    }
+    return r->pos;
+}
+
+/* The workloads of one key type, m and copy are map_t(KT, size_t) */
+typedef struct {
+    const char *name;
+    size_t ksize, msize;
+    void (*make)(run_t *r, size_t id, void *key);
+    void (*init)(void *m, int engine);
+    size_t (*batch)(void *m, int op, const void *keys, size_t count);
+    size_t (*iterate)(void *m);
+    int (*copy)(void *dst, void *src);
+    int (*equal)(void *m1, void *m2);
+    void (*destroy)(void *m);
+} keytype_t;
+
+#define BENCH_KEYTYPE(NAME, KT, CMP, HASH)                                               \
+    typedef map_t(KT, size_t) map_##NAME##_t;                                            \
+                                                                                         \
+    static void NAME##_init(void *m, int engine) {                                       \
+        map_##NAME##_t *mp = (map_##NAME##_t *) m;                                       \
+        if (engine == ENGINE_POOL) {                                                     \
+            map_init_pool(mp, CMP, HASH, &counting);                                     \
+            return;                                                                      \
+        }                                                                                \
+        if (engine == ENGINE_FLAT) {                                                     \
+            map_init_flat(mp, CMP, HASH);                                                \
+        } else if (engine == ENGINE_DENSE) {                                             \
+            map_init_dense(mp, CMP, HASH);                                               \
+        } else if (engine == ENGINE_INCREMENTAL) {                                       \
+            map_init_incremental(mp, CMP, HASH);                                         \
+        } else {                                                                         \
+            map_init(mp, CMP, HASH);                                                     \
+        }                                                                                \
+        map_use_allocator(mp, &counting);                                                \
+    }                                                                                    \
+                                                                                         \
+    static size_t NAME##_batch(void *m, int op, const void *keys, size_t count) {        \
+        map_##NAME##_t *mp = (map_##NAME##_t *) m;                                       \
+        const KT *k = (const KT *) keys;                                                 \
+        size_t i, res = 0;                                                               \
+        for (i = 0; i < count; i++) {                                                    \
+            if (op == OP_INSERT) {                                                       \
+                res += map_set(mp, k[i], i);                                             \
+            } else if (op == OP_REMOVE) {                                                \
+                map_remove(mp, k[i]);                                                    \
+            } else {                                                                     \
+                res += (map_get(mp, k[i]) != NULL);                                      \
+            }                                                                            \
+        }                                                                                \
+        return res;                                                                      \
+    }                                                                                    \
+                                                                                         \
+    static size_t NAME##_iterate(void *m) {                                              \
+        map_##NAME##_t *mp = (map_##NAME##_t *) m;                                       \
+        map_iter_t it = map_iter(mp);                                                    \
+        KT key;                                                                          \
+        size_t n = 0;                                                                    \
+        while (map_next(mp, &it, &key)) {                                                \
+            n++;                                                                         \
+        }                                                                                \
+        return n;                                                                        \
+    }                                                                                    \
+                                                                                         \
+    static int NAME##_copy(void *dst, void *src) {                                       \
+        return map_copy((map_##NAME##_t *) dst, (map_##NAME##_t *) src);                 \
+    }                                                                                    \
+                                                                                         \
+    static int NAME##_equal(void *m1, void *m2) {                                        \
+        return map_equal((map_##NAME##_t *) m1, (map_##NAME##_t *) m2, NULL);            \
+    }                                                                                    \
+                                                                                         \
+    static void NAME##_destroy(void *m) {                                                \
+        map_delete((map_##NAME##_t *) m);                                                \
+    }
+
+typedef struct {
+    unsigned char bytes[16];
+} key16_t;
+
+typedef const char *cstr_t;
+
+BENCH_KEYTYPE(int, int, NULL, NULL)
+BENCH_KEYTYPE(double, double, NULL, NULL)
+BENCH_KEYTYPE(struct16, key16_t, NULL, NULL)
+BENCH_KEYTYPE(string, cstr_t, map_string_cmp, map_string_hash)
+
+static void make_int(run_t *r, size_t id, void *key) {
+    *(int *) key = (int) key_value(r, id);
+}
+
+static void make_double(run_t *r, size_t id, void *key) {
+    *(double *) key = (double) key_value(r, id) + 0.5;
+}
+
+static void make_struct16(run_t *r, size_t id, void *key) {
+    unsigned long v = key_value(r, id);
+    key16_t *k = (key16_t *) key;
+    memset(k, 0x5a, sizeof(*k));
+    k->bytes[12] = (unsigned char) v;
+    k->bytes[13] = (unsigned char) (v >> 8);
+    k->bytes[14] = (unsigned char) (v >> 16);
+    k->bytes[15] = (unsigned char) (v >> 24);
+}
+
+/* Keys of the map point into the pool, misses into a ring big enough for one chunk */
+static void make_string(run_t *r, size_t id, void *key) {
+    static char ring[CHUNK][STRLEN];
+    static size_t next;
+    char *s;
+    if (id < r->n) {
+        s = r->strpool + id * STRLEN;
+    } else {
+        s = ring[next++ % CHUNK];
+        sprintf(s, "%08lx-k", key_value(r, id));
+    }
+    *(const char **) key = s;
+}
+
+#define KEYTYPE(NAME)                                                                    \
+    {#NAME, sizeof(*((map_##NAME##_t *) 0)->keyref), sizeof(map_##NAME##_t), make_##NAME, \
+     NAME##_init, NAME##_batch, NAME##_iterate, NAME##_copy, NAME##_equal, NAME##_destroy}
+
+static const keytype_t keytypes[] = {KEYTYPE(int), KEYTYPE(double), KEYTYPE(struct16), KEYTYPE(string)};
+
+#define NKEYTYPES (sizeof(keytypes) / sizeof(keytypes[0]))
+
+/* Rows of the baseline run */
+typedef struct {
+    char engine[32], key[32], dist[32], op[32];
+    size_t size;
+    double ns;
+} row_t;
+
+static row_t *baseline;
+static size_t nbaseline;
+
+static int load_baseline(const char *path) {
+    char line[256];
+    row_t row, *rows;
+    unsigned long size;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%31[^,],%31[^,],%31[^,],%lu,%31[^,],%lf", row.engine, row.key, row.dist, &size, row.op, &row.ns) != 6) {
+            continue; /* header */
+        }
+        if ((rows = (row_t *) realloc(baseline, (nbaseline + 1) * sizeof(*rows))) == NULL) {
+            fclose(f);
+            return 0;
+        }
+        row.size = size;
+        baseline = rows;
+        baseline[nbaseline++] = row;
+    }
+    fclose(f);
+    return 1;
+}
+
+static const row_t *find_baseline(const char *engine, const char *key, const char *dist, size_t size, const char *op) {
+    size_t i;
+    for (i = 0; i < nbaseline; i++) {
+        if (baseline[i].size == size && strcmp(baseline[i].engine, engine) == 0 && strcmp(baseline[i].key, key) == 0
+            && strcmp(baseline[i].dist, dist) == 0 && strcmp(baseline[i].op, op) == 0) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
+
+static void report(const keytype_t *kt, const run_t *r, int op, double seconds, size_t ops) {
+    const row_t *base;
+    double ns = (ops > 0) ? seconds * 1e9 / (double) ops : 0;
+    printf("%s,%s,%s,%lu,%s,%.2f,%lu,%lu,%ld", engine_names[r->engine], kt->name, dist_names[r->dist],
+           (unsigned long) r->n, op_names[op], ns, (unsigned long) nallocs, (unsigned long) peak_bytes, peak_rss_kb());
+    if (baseline != NULL) {
+        base = find_baseline(engine_names[r->engine], kt->name, dist_names[r->dist], r->n, op_names[op]);
+        if (base != NULL && base->ns > 0) {
+            printf(",%.2f,%+.1f", base->ns, (ns - base->ns) / base->ns * 100);
+        } else {
+            printf(",,");
+        }
+    }
+    putchar('\n');
+    fflush(stdout);
+}
+
+static void reset_counters(void) {
+    nallocs = 0;
+    peak_bytes = live_bytes;
+}
+
+/* Runs op over n keys in chunks, only the map calls are timed; returns the batch results */
+static size_t timed_batches(const keytype_t *kt, run_t *r, void *m, int op, char *keys, double *seconds) {
+    size_t i, j, count, res = 0;
+    double start;
+    *seconds = 0;
+    for (i = 0; i < r->n; i += count) {
+        count = (r->n - i < CHUNK) ? r->n - i : CHUNK;
+        for (j = 0; j < count; j++) {
+            size_t id = (op == OP_INSERT) ? i + j : (op == OP_REMOVE) ? remove_id(r, i + j) : lookup_id(r, i + j);
+            kt->make(r, (op == OP_MISS) ? id + r->n : id, keys + j * kt->ksize);
+        }
+        start = now();
+        res += kt->batch(m, op, keys, count);
+        *seconds += now() - start;
+    }
+    return res;
+}
+
+static int bench(const keytype_t *kt, run_t *r) {
+    void *m = malloc(kt->msize), *copy = malloc(kt->msize);
+    char *keys = (char *) malloc(CHUNK * kt->ksize);
+    double seconds, start;
+    size_t res, i;
+    int ok = 0;
+    r->strpool = NULL;
+    if (m == NULL || copy == NULL || keys == NULL) {
+        goto done;
+    }
+    if (strcmp(kt->name, "string") == 0) {
+        if ((r->strpool = (char *) malloc(r->n * STRLEN)) == NULL) {
+            goto done;
+        }
+        for (i = 0; i < r->n; i++) {
+            sprintf(r->strpool + i * STRLEN, "%08lx-k", key_value(r, i));
+        }
+    }
+    r->rng = 2463534242UL;
+    kt->init(m, r->engine);
+    kt->init(copy, r->engine);
+
+    reset_counters();
+    res = timed_batches(kt, r, m, OP_INSERT, keys, &seconds);
+    report(kt, r, OP_INSERT, seconds, r->n);
+    if (res != r->n) {
+        fprintf(stderr, "insert failed\n");
+        goto fail;
+    }
+    reset_counters();
+    res = timed_batches(kt, r, m, OP_HIT, keys, &seconds);
+    report(kt, r, OP_HIT, seconds, r->n);
+    if (res != r->n) {
+        fprintf(stderr, "lookup missed a key\n");
+        goto fail;
+    }
+    reset_counters();
+    res = timed_batches(kt, r, m, OP_MISS, keys, &seconds);
+    report(kt, r, OP_MISS, seconds, r->n);
+
+    reset_counters();
+    start = now();
+    res = kt->iterate(m);
+    report(kt, r, OP_ITERATE, now() - start, r->n);
+    reset_counters();
+    start = now();
+    res = (size_t) kt->copy(copy, m);
+    report(kt, r, OP_COPY, now() - start, r->n);
+    if (!res) {
+        fprintf(stderr, "copy failed\n");
+        goto fail;
+    }
+    reset_counters();
+    start = now();
+    res = (size_t) kt->equal(m, copy);
+    report(kt, r, OP_EQUAL, now() - start, r->n);
+    /* Gone before the removals are timed, so the cleanup below skips it */
+    kt->destroy(copy);
+    free(copy);
+    copy = NULL;
+
+    reset_counters();
+    timed_batches(kt, r, m, OP_REMOVE, keys, &seconds);
+    report(kt, r, OP_REMOVE, seconds, r->n);
+    ok = 1;
+fail:
+    kt->destroy(m);
+    if (copy != NULL) {
+        kt->destroy(copy);
+    }
+done:
+    free(r->strpool);
+    free(keys);
+    free(copy);
+    free(m);
+    return ok;
+}
+
+/* Index of name in names, or -1 */
+static int lookup_name(const char *const *names, size_t count, const char *name) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/* Sets selected[i] for every name of a comma separated list */
+static int select_names(const char *const *names, size_t count, char *list, int *selected) {
+    char *tok;
+    int i;
+    memset(selected, 0, count * sizeof(*selected));
+    for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        if ((i = lookup_name(names, count, tok)) < 0) {
+            fprintf(stderr, "unknown name: %s\n", tok);
+            return 0;
+        }
+        selected[i] = 1;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    static const char *keytype_names[NKEYTYPES];
+    char default_sizes[] = "1e3,1e4,1e5,1e6", *sizes = default_sizes, *tok;
+    int engines[NENGINES] = {1, 1, 1, 0, 0}, dists[NDISTS] = {1, 1, 1}, keys[NKEYTYPES];
+    size_t nsizes = 0, sizelist[32], i, k;
+    int a, e, d;
+    run_t r;
+    for (i = 0; i < NKEYTYPES; i++) {
+        keytype_names[i] = keytypes[i].name;
+        keys[i] = 1;
+    }
+    for (a = 1; a + 1 < argc; a += 2) {
+        if (strcmp(argv[a], "-s") == 0) {
+            sizes = argv[a + 1];
+        } else if (strcmp(argv[a], "-k") == 0) {
+            if (!select_names(keytype_names, NKEYTYPES, argv[a + 1], keys)) return EXIT_FAILURE;
+        } else if (strcmp(argv[a], "-d") == 0) {
+            if (!select_names(dist_names, NDISTS, argv[a + 1], dists)) return EXIT_FAILURE;
+        } else if (strcmp(argv[a], "-e") == 0) {
+            if (!select_names(engine_names, NENGINES, argv[a + 1], engines)) return EXIT_FAILURE;
+        } else if (strcmp(argv[a], "-b") == 0) {
+            if (!load_baseline(argv[a + 1])) {
+                fprintf(stderr, "cannot read baseline %s\n", argv[a + 1]);
+                return EXIT_FAILURE;
+            }
+        } else {
+            break;
+        }
+    }
+    if (a < argc) {
+        fprintf(stderr, "usage: %s [-s sizes] [-k keys] [-d dists] [-e engines] [-b baseline.csv]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (tok = strtok(sizes, ","); tok != NULL && nsizes < 32; tok = strtok(NULL, ",")) {
+        if ((sizelist[nsizes++] = (size_t) strtod(tok, NULL)) == 0) {
+            fprintf(stderr, "bad size: %s\n", tok);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("engine,key,dist,size,op,ns_per_op,allocs,peak_bytes,peak_rss_kb%s\n",
+           (baseline != NULL) ? ",base_ns_per_op,change_pct" : "");
+    for (i = 0; i < nsizes; i++) {
+        r.n = sizelist[i];
+        if (dists[DIST_ZIPF]) {
+            zipf_init(&r.zipf, r.n);
+        }
+        for (k = 0; k < NKEYTYPES; k++) {
+            for (d = 0; d < NDISTS; d++) {
+                for (e = 0; e < NENGINES; e++) {
+                    if (!keys[k] || !dists[d] || !engines[e]) {
+                        continue;
+                    }
+                    r.engine = e;
+                    r.dist = d;
+                    if (!bench(&keytypes[k], &r)) {
+                        return EXIT_FAILURE;
+                    }
+                }
+            }
+        }
+    }
+    free(baseline);
+    return EXIT_SUCCESS;
+}
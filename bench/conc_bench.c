@@ -0,0 +1,122 @@
+/*
+ * Throughput of the concurrent map against a map_t behind one mutex, for growing thread
+ * counts. Every thread runs the same mix of lookups and updates on a shared key range.
+ * Usage: cmap_conc_bench [max threads] [ops per thread] [update percent]
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <cmap.h>
+#include <cmap_conc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>   /* clock_gettime */
+#include <unistd.h> /* sysconf */
+
+#define NKEYS (1u << 16)
+
+typedef map_t(unsigned, unsigned) map_u_u;
+typedef map_conc_t(unsigned, unsigned) map_conc_u_u;
+
+static map_u_u locked;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static map_conc_u_u conc;
+static unsigned long nops, update_pct;
+
+typedef struct {
+    pthread_t thread;
+    unsigned long seed, hits;
+} worker_t;
+
+static unsigned long xorshift(unsigned long *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static void *run_locked(void *arg) {
+    worker_t *w = (worker_t *) arg;
+    unsigned long i, r;
+    unsigned k;
+    for (i = 0; i < nops; i++) {
+        r = xorshift(&w->seed);
+        k = (unsigned) (r >> 8) & (NKEYS - 1);
+        pthread_mutex_lock(&lock);
+        if (r % 100 < update_pct) {
+            map_set(&locked, k, k);
+        } else if (map_get(&locked, k) != NULL) {
+            w->hits++;
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static void *run_conc(void *arg) {
+    worker_t *w = (worker_t *) arg;
+    unsigned long i, r;
+    unsigned k, v;
+    for (i = 0; i < nops; i++) {
+        r = xorshift(&w->seed);
+        k = (unsigned) (r >> 8) & (NKEYS - 1);
+        if (r % 100 < update_pct) {
+            map_conc_set(&conc, &k, &k);
+        } else if (map_conc_get(&conc, &k, &v)) {
+            w->hits++;
+        }
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* Millions of operations per second over all threads */
+static double measure(void *(*run)(void *), worker_t *workers, unsigned nthreads) {
+    unsigned i;
+    double start = now();
+    for (i = 0; i < nthreads; i++) {
+        workers[i].seed = 2463534242UL + i * 7919UL;
+        workers[i].hits = 0;
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    return (double) nops * nthreads / (now() - start) / 1e6;
+}
+
+int main(int argc, char **argv) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned maxthreads = (argc > 1) ? (unsigned) atoi(argv[1]) : (ncpu > 0 ? (unsigned) ncpu : 4);
+    unsigned nthreads, k;
+    worker_t *workers;
+    nops = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1000000UL;
+    update_pct = (argc > 3) ? strtoul(argv[3], NULL, 10) : 10;
+    if (maxthreads == 0 || (workers = (worker_t *) malloc(maxthreads * sizeof(*workers))) == NULL) {
+        return EXIT_FAILURE;
+    }
+    map_stdinit(&locked);
+    if (!map_conc_stdinit(&conc)) {
+        return EXIT_FAILURE;
+    }
+    for (k = 0; k < NKEYS; k += 2) {
+        if (!map_set(&locked, k, k) || !map_conc_set(&conc, &k, &k)) {
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%lu ops per thread, %lu%% updates\n", nops, update_pct);
+    printf("%8s %14s %14s\n", "threads", "mutex Mops/s", "conc Mops/s");
+    for (nthreads = 1; nthreads <= maxthreads; nthreads = (nthreads * 2 > maxthreads && nthreads < maxthreads) ? maxthreads : nthreads * 2) {
+        printf("%8u %14.2f", nthreads, measure(run_locked, workers, nthreads));
+        printf(" %14.2f\n", measure(run_conc, workers, nthreads));
+    }
+    map_delete(&locked);
+    map_conc_delete(&conc);
+    free(workers);
+    return EXIT_SUCCESS;
+}
@@ -5,18 +5,89 @@
  * under the terms of the MIT license. See LICENSE for details.
  */
 
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#define MAP_MMAP
+#endif
+
+#include <stdio.h>  /* FILE, fopen, fread, fwrite, remove, rename */
 #include <stdlib.h> /* malloc, realloc */
-#include <string.h> /* strcmp, memset, memcmp, memcpy */
+#include <string.h> /* strcmp, strlen, strcpy, strcat, memset, memcmp, memcpy */
 #include "cmap.h"
 
-typedef struct map_node_t map_node_t;
+#ifdef MAP_STATS
+#include <time.h> /* clock */
+#endif
 
-struct map_node_t {
-    size_t hash;
-    void *key;
-    void *value;
-    map_node_t *next;
-};
+#ifdef MAP_THREADS
+#include <pthread.h> /* pthread_create, pthread_join */
+#include <unistd.h>  /* sysconf */
+#endif
+
+#ifdef MAP_MMAP
+#include <fcntl.h>    /* open */
+#include <sys/mman.h> /* mmap, munmap */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h>   /* close */
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MAP_SSE2
+#include <emmintrin.h> /* _mm_* */
+#endif
+
+#if defined(__GNUC__)
+#define MAP_PREFETCH(addr) __builtin_prefetch(addr)
+#elif defined(MAP_SSE2)
+#define MAP_PREFETCH(addr) _mm_prefetch((const char *) (addr), _MM_HINT_T0)
+#else
+#define MAP_PREFETCH(addr) ((void) (addr))
+#endif
+
+typedef union {
+    long double ld;
+    double d;
+    long l;
+    void *p;
+    void (*fp)(void);
+} map_maxalign_t;
+
+/* Largest alignment an object of that size might need, none for the empty values of sets */
+static size_t map_sizealign(size_t size) {
+    size_t a = size & (0 - size);
+    if (size == 0) {
+        return 1;
+    }
+    return (a > sizeof(map_maxalign_t)) ? sizeof(map_maxalign_t) : a;
+}
+
+static size_t map_roundup(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+static void *map_malloc(map_base_t *m, size_t size) {
+    const map_allocator_t *a = m->allocator;
+    return (a != NULL) ? a->alloc(a->udata, size) : malloc(size);
+}
+
+static void *map_realloc(map_base_t *m, void *ptr, size_t size) {
+    const map_allocator_t *a = m->allocator;
+    return (a != NULL) ? a->realloc(a->udata, ptr, size) : realloc(ptr, size);
+}
+
+static void map_free(map_base_t *m, void *ptr) {
+    const map_allocator_t *a = m->allocator;
+    if (ptr == NULL) {
+        return;
+    }
+    if (a != NULL) {
+        a->free(a->udata, ptr);
+    } else {
+        free(ptr);
+    }
+}
 
 /* djb2 hashing algorithm */
 size_t map_generic_hash(const void *mem, size_t memsize) {
@@ -40,6 +111,111 @@ size_t map_string_hash(const void *mem, size_t memsize) {
     return hash;
 }
 
+/*
+ * Word-at-a-time hashing. Constants and rounds are the 64-bit ones of xxHash/splitmix,
+ * built from 32-bit halves so that they truncate to odd 32-bit multipliers where size_t is 32-bit.
+ */
+#define MAP_K(hi, lo) (((size_t) (hi) << 16 << 16) | (size_t) (lo))
+#define MAP_ROTL(x, r) (((x) << (r)) | ((x) >> (sizeof(size_t) * 8 - (r))))
+
+static size_t map_load(const unsigned char *p) {
+    size_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static size_t map_hash_round(size_t h, size_t w) {
+    h += w * MAP_K(0xC2B2AE3DUL, 0x27D4EB4FUL);
+    h = MAP_ROTL(h, sizeof(size_t) * 4 - 1);
+    return h * MAP_K(0x9E3779B1UL, 0x85EBCA87UL);
+}
+
+static size_t map_hash_mix(size_t h) {
+    h ^= h >> 30;
+    h *= MAP_K(0xBF58476DUL, 0x1CE4E5B9UL);
+    h ^= h >> 27;
+    h *= MAP_K(0x94D049BBUL, 0x133111EBUL);
+    return h ^ (h >> 31);
+}
+
+size_t map_fast_hash_seeded(const void *mem, size_t memsize, size_t seed) {
+    const unsigned char *p = (const unsigned char *) mem;
+    size_t h = seed ^ (memsize * MAP_K(0x9E3779B9UL, 0x7F4A7C15UL)), w;
+    if (memsize <= sizeof(size_t)) {
+        /* 4 and 8 byte keys: a single mixing round */
+        w = 0;
+        memcpy(&w, p, memsize);
+        return map_hash_mix(h ^ w);
+    }
+    while (memsize > sizeof(size_t)) {
+        h = map_hash_round(h, map_load(p));
+        p += sizeof(size_t);
+        memsize -= sizeof(size_t);
+    }
+    /* Last word, overlapping the previous one when the size isn't a multiple of it */
+    h = map_hash_round(h, map_load(p + memsize - sizeof(size_t)));
+    return map_hash_mix(h);
+}
+
+size_t map_fast_string_hash_seeded(const void *mem, size_t memsize, size_t seed) {
+    const char *str = *(const char **) mem;
+    (void) memsize;
+    return map_fast_hash_seeded(str, strlen(str), seed);
+}
+
+size_t map_fast_hash(const void *mem, size_t memsize) {
+    return map_fast_hash_seeded(mem, memsize, 0);
+}
+
+size_t map_fast_string_hash(const void *mem, size_t memsize) {
+    return map_fast_string_hash_seeded(mem, memsize, 0);
+}
+
+/*
+ * Fibonacci hashing of integer and pointer keys: the key times 2^N / phi, rotated so that
+ * the high half of the product, which every bit of the key reaches, ends up in the low bits
+ * the engines take bucket indices from. Both steps are bijective, so for keys of at most
+ * sizeof(size_t) bytes equal hashes mean equal keys and MAP_INTKEYS_ maps never call cmp_func.
+ */
+size_t map_int_hash(const void *mem, size_t memsize) {
+    size_t x = 0;
+    unsigned u;
+    if (memsize == sizeof(size_t)) {
+        memcpy(&x, mem, sizeof(size_t));
+    } else if (memsize == sizeof(unsigned)) {
+        memcpy(&u, mem, sizeof(unsigned));
+        x = u;
+    } else if (memsize < sizeof(size_t)) {
+        memcpy(&x, mem, memsize);
+    } else {
+        return map_fast_hash(mem, memsize);
+    }
+    x *= (sizeof(size_t) > 4) ? MAP_K(0x9E3779B9UL, 0x7F4A7C15UL) : (size_t) 0x9E3779B9UL;
+    return MAP_ROTL(x, sizeof(size_t) * 4);
+}
+
+/* Hash of a key in a frozen map. Plain and string keys are hashed again with the
+ * fast hash so freezing can try seeds until no two hashes are equal, other keys
+ * keep the map's hash */
+static size_t map_frozen_hash(map_base_t *m, const void *key, size_t ksize, size_t seed) {
+    const char *str;
+    if (m->cmp_func == map_string_cmp) {
+        str = *(const char * const *) key;
+        return map_fast_hash_seeded(str, strlen(str), seed);
+    }
+    if (m->cmp_func == map_generic_cmp) {
+        return map_fast_hash_seeded(key, ksize, seed);
+    }
+    return (m->seed_hash_func != NULL) ? m->seed_hash_func(key, ksize, m->seed) : m->hash_func(key, ksize);
+}
+
+static size_t map_hash(map_base_t *m, const void *key, size_t ksize) {
+    if (m->flags & MAP_FROZEN_) {
+        return map_frozen_hash(m, key, ksize, m->pseed);
+    }
+    return (m->seed_hash_func != NULL) ? m->seed_hash_func(key, ksize, m->seed) : m->hash_func(key, ksize);
+}
+
 int map_generic_cmp(const void *a, const void *b, size_t memsize) {
     return memcmp(a, b, memsize);
 }
@@ -49,17 +225,159 @@ int map_string_cmp(const void *a, const void *b, size_t memsize) {
     return strcmp(*(const char **) a, *(const char **) b);
 }
 
-static map_node_t *map_newnode(const void *key, size_t ksize, size_t koffset, const void *value, size_t vsize, size_t voffset, MapHashFunction hash_func) {
+/*
+ * Owned string keys, see map_init_strkeys.
+ * The stored char * points right behind a size_t holding the string's length,
+ * inside the node itself for chained maps and in a separate block for flat ones.
+ * Lookups compare a map_slice_t against it, so the length of the key being
+ * looked up is computed once and most mismatches never touch the bytes.
+ */
+
+typedef struct {
+    const char *str;
+    size_t len;
+} map_slice_t;
+
+#define MAP_STRLEN(str) (((const size_t *) (const void *) (str))[-1])
+
+static int map_strkey_cmp(const void *slice, const void *stored, size_t memsize) {
+    const map_slice_t *s = (const map_slice_t *) slice;
+    const char *str = *(const char * const *) stored;
+    (void) memsize;
+    return (MAP_STRLEN(str) == s->len) ? memcmp(s->str, str, s->len) : 1;
+}
+
+static size_t map_strkey_size(const map_slice_t *s) {
+    return sizeof(size_t) + s->len + 1;
+}
+
+/* Copies the string into mem, which is map_strkey_size() bytes, and returns the copy */
+static char *map_strkey_init(void *mem, const map_slice_t *s) {
+    char *str = (char *) ((size_t *) mem + 1);
+    *(size_t *) mem = s->len;
+    memcpy(str, s->str, s->len);
+    str[s->len] = '\0';
+    return str;
+}
+
+static void *map_strkey_block(const void *stored) {
+    return (size_t *) *(char * const *) stored - 1;
+}
+
+/* Key being looked up: what cmp takes as its first argument, and its hash */
+typedef struct {
+    const void *key;
+    MapCmpFunction cmp;
+    size_t hash;
+    map_slice_t str;
+} map_lookup_t;
+
+/* Whether the key being looked up, whose hash matched, equals the stored one */
+#define MAP_KEYEQ(m, l, stored, ksize) \
+    (((m)->flags & MAP_INTKEYS_) || (MAP_COUNT(m, comparisons), (l)->cmp((l)->key, (stored), (ksize))) == 0)
+
+/* Whether a small map still keeps its entries inline, see map_init_small */
+#define MAP_INLINED(m) (((m)->flags & (MAP_SMALL_ | MAP_FROZEN_)) == MAP_SMALL_ && (m)->nbuckets == 0)
+
+/* The inline buffer moves with the map_t, so it's found again before every use */
+static void map_small_sync(map_base_t *m) {
+    /* Only written when moved, so threads scanning the map only ever read it */
+    if (MAP_INLINED(m) && m->entries != (char *) m + m->smalloff) {
+        m->entries = (char *) m + m->smalloff;
+    }
+}
+
+static void map_lookup_init_hashed(map_base_t *m, map_lookup_t *l, const void *key, size_t hash) {
+    map_small_sync(m);
+    l->hash = hash;
+    if (m->flags & MAP_STRKEYS_) {
+        l->str.str = *(const char * const *) key;
+        l->str.len = strlen(l->str.str);
+        l->key = &l->str;
+        l->cmp = map_strkey_cmp;
+    } else {
+        l->key = key;
+        l->cmp = m->cmp_func;
+    }
+}
+
+static void map_lookup_init(map_base_t *m, map_lookup_t *l, const void *key, size_t ksize) {
+    map_lookup_init_hashed(m, l, key, map_hash(m, key, ksize));
+}
+
+/*
+ * Slab pool, see map_init_pool.
+ * Nodes of a map all have the same size, so they are carved out of chunks of
+ * MAP_POOL_CHUNK bytes. Removed nodes go to a free list linked through node->next,
+ * chunks are linked through their first pointer and only released by map_delete_.
+ */
+
+#define MAP_POOL_CHUNK 65536u
+/* Owned string keys make node sizes vary, those nodes are always malloc'ed */
+#define MAP_POOLED(m) (((m)->flags & (MAP_POOL_ | MAP_STRKEYS_)) == MAP_POOL_)
+
+static map_node_t *map_pool_alloc(map_base_t *m, size_t nodesize) {
+    size_t hdr = map_roundup(sizeof(void *), sizeof(map_maxalign_t)), count, i;
+    map_node_t *node;
+    char *chunk;
+    if (m->pool_free == NULL) {
+        nodesize = map_roundup(nodesize, sizeof(map_maxalign_t));
+        count = (MAP_POOL_CHUNK - hdr) / nodesize;
+        if (count < 16) {
+            count = 16;
+        }
+        chunk = (char *) map_malloc(m, hdr + count * nodesize);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        *(void **) chunk = m->pool_chunks;
+        m->pool_chunks = chunk;
+        /* Thread the free list through the new nodes, lowest address first */
+        for (i = count; i--;) {
+            node = (map_node_t *) (chunk + hdr + i * nodesize);
+            node->next = (map_node_t *) m->pool_free;
+            m->pool_free = node;
+        }
+    }
+    node = (map_node_t *) m->pool_free;
+    m->pool_free = node->next;
+    return node;
+}
+
+static void map_freenode(map_base_t *m, map_node_t *node) {
+    if (MAP_POOLED(m)) {
+        node->next = (map_node_t *) m->pool_free;
+        m->pool_free = node;
+    } else {
+        map_free(m, node);
+    }
+}
+
+static map_node_t *map_newnode(map_base_t *m, const map_lookup_t *l, const void *key, size_t ksize, size_t koffset, const void *value, size_t vsize, size_t voffset) {
     map_node_t *node;
-    node = (map_node_t *) malloc(sizeof(*node) + koffset + ksize + voffset + vsize);
+    size_t nodesize = sizeof(*node) + koffset + ksize + voffset + vsize, strkey = 0;
+    if (m->flags & MAP_STRKEYS_) {
+        /* The string copy follows the value */
+        strkey = nodesize = map_roundup(nodesize, sizeof(size_t));
+        nodesize += map_strkey_size(&l->str);
+    }
+    if (MAP_POOLED(m)) {
+        node = map_pool_alloc(m, nodesize);
+    } else {
+        node = (map_node_t *) map_malloc(m, nodesize);
+    }
     if (node == NULL) {
         return NULL;
     }
     node->key = (char *)(node + 1) + koffset;
     node->value = (char *)(node + 1) + voffset;
-    memcpy(node->key, key, ksize);
+    if (strkey) {
+        *(char **) node->key = map_strkey_init((char *) node + strkey, &l->str);
+    } else {
+        memcpy(node->key, key, ksize);
+    }
     memcpy(node->value, value, vsize);
-    node->hash = hash_func(key, ksize); /* Call map-specific hash function */
+    node->hash = l->hash; /* key may be a slice, keep the hash it was looked up with */
     node->next = NULL;
     return node;
 }
@@ -79,10 +397,143 @@ static void map_addnode(map_base_t *m, map_node_t *node) {
 }
 
 
+/*
+ * Capacity, see map_load_factor.
+ * A map grows once an insert would take it over growat entries and, if it has
+ * a minimum load, shrinks when a removal leaves it with fewer than shrinkat.
+ * Both are refreshed by map_setlimits whenever the bucket count changes.
+ */
+
+#define MAP_GROUP 16
+
+/* Maximum amount of used (full or deleted) slots of the flat engine, 7/8 load factor */
+static size_t map_flat_limit(size_t nslots) {
+    return nslots - nslots / 8;
+}
+
+/* Entries nbuckets can hold before the map grows */
+static size_t map_capacity(map_base_t *m, size_t nbuckets) {
+    size_t cap = (size_t) ((double) nbuckets * m->maxload);
+    if ((m->flags & MAP_FLAT_) && cap > map_flat_limit(nbuckets)) {
+        cap = map_flat_limit(nbuckets);
+    }
+    if ((m->flags & MAP_DENSE_) && cap > nbuckets - nbuckets / 4) {
+        /* Linear probing slows down quickly past 3/4 full */
+        cap = nbuckets - nbuckets / 4;
+    }
+    return cap;
+}
+
+/* Smallest bucket count able to hold nentries */
+static size_t map_nbuckets_for(map_base_t *m, size_t nentries) {
+    size_t n = (m->flags & MAP_FLAT_) ? MAP_GROUP : (m->flags & MAP_DENSE_) ? 8 : 1;
+    while (map_capacity(m, n) < nentries) {
+        n *= 2;
+    }
+    return n;
+}
+
+static void map_setlimits(map_base_t *m) {
+    m->growat = map_capacity(m, m->nbuckets);
+    m->shrinkat = (size_t) ((double) m->nbuckets * m->minload);
+}
+
+
+/*
+ * Operation counters reported by map_stats, only kept when compiled with MAP_STATS.
+ * Every key lookup counts as a hit or a miss, every cmp_func call as a comparison.
+ */
+
+#ifdef MAP_STATS
+#define MAP_COUNT(m, counter) ((void) ((m)->counters.counter++))
+
+static int map_count_resize(map_base_t *m, int (*resize)(map_base_t *, size_t), size_t nbuckets) {
+    clock_t start = clock();
+    int ok = resize(m, nbuckets);
+    m->counters.resizes++;
+    m->counters.resize_seconds += (double) (clock() - start) / CLOCKS_PER_SEC;
+    return ok;
+}
+
+#define MAP_RESIZE(m, resize, nbuckets) map_count_resize(m, resize, nbuckets)
+#define MAP_CACHE_COUNT(m, counter) MAP_COUNT(m, counter)
+#else
+#define MAP_COUNT(m, counter) ((void) 0)
+#define MAP_RESIZE(m, resize, nbuckets) resize(m, nbuckets)
+/* Cache maps count their hits and misses either way */
+#define MAP_CACHE_COUNT(m, counter) ((void) (((m)->flags & MAP_CACHE_) && (m)->counters.counter++))
+#endif
+
+
+/*
+ * Incremental resize, see map_init_incremental.
+ * Growing only allocates the new bucket array; the old one is kept in oldbuckets
+ * and every map_get_/map_set_/map_remove_ moves MAP_REHASH_STEP of its buckets over.
+ * Old buckets below `migrated` are empty, so a key lives in the old array if its
+ * old bucket index is >= migrated and in the new one otherwise.
+ */
+
+#define MAP_REHASH_STEP 8
+
+static void map_rehash_step(map_base_t *m, size_t nsteps) {
+    map_node_t *node, *next;
+    while (m->oldbuckets != NULL && nsteps--) {
+        node = m->oldbuckets[m->migrated];
+        while (node != NULL) {
+            next = node->next;
+            map_addnode(m, node);
+            node = next;
+        }
+        m->oldbuckets[m->migrated] = NULL;
+        if (++m->migrated == m->noldbuckets) {
+            map_free(m, m->oldbuckets);
+            m->oldbuckets = NULL;
+            m->noldbuckets = 0;
+            m->migrated = 0;
+        }
+    }
+}
+
+static void map_rehash_finish(map_base_t *m) {
+    map_rehash_step(m, (size_t) -1);
+}
+
+/* Head of the chain the node with this hash belongs to */
+static map_node_t **map_bucketref(map_base_t *m, size_t hash) {
+    size_t i;
+    if (m->oldbuckets != NULL && (i = hash & (m->noldbuckets - 1)) >= m->migrated) {
+        return &m->oldbuckets[i];
+    }
+    return &m->buckets[map_bucketidx(m, hash)];
+}
+
+static int map_resize_incremental(map_base_t *m, size_t nbuckets) {
+    map_node_t **buckets;
+    map_rehash_finish(m);
+    buckets = (map_node_t **) map_malloc(m, sizeof(*buckets) * nbuckets);
+    if (buckets == NULL) {
+        return 0;
+    }
+    memset(buckets, 0, sizeof(*buckets) * nbuckets);
+    if (m->nnodes > 0) {
+        m->oldbuckets = m->buckets;
+        m->noldbuckets = m->nbuckets;
+        m->migrated = 0;
+    } else {
+        map_free(m, m->buckets);
+    }
+    m->buckets = buckets;
+    m->nbuckets = nbuckets;
+    map_setlimits(m);
+    return 1;
+}
+
+
 static int map_resize(map_base_t *m, size_t nbuckets) {
     map_node_t *nodes, *node, *next;
     map_node_t **buckets;
     size_t i;
+    map_rehash_finish(m);
     /* Chain all nodes together */
     nodes = NULL;
     i = m->nbuckets;
@@ -95,150 +546,1754 @@ static int map_resize(map_base_t *m, size_t nbuckets) {
             node = next;
         }
     }
-    /* Reset buckets */
-    buckets = (map_node_t **) realloc(m->buckets, sizeof(*m->buckets) * nbuckets);
+    /* Reset buckets, the old ones are reused if realloc() failed */
+    buckets = (map_node_t **) map_realloc(m, m->buckets, sizeof(*m->buckets) * nbuckets);
     if (buckets != NULL) {
         m->buckets = buckets;
         m->nbuckets = nbuckets;
-        /* todo: introduce a portable ifdef. NULL's bits aren't always all-zeros */
-        memset(m->buckets, 0, sizeof(*m->buckets) * m->nbuckets);
-        /* Re-add nodes to buckets */
-        node = nodes;
-        while (node != NULL) {
-            next = node->next;
-            map_addnode(m, node);
-            node = next;
-        }
+        map_setlimits(m);
+    }
+    /* todo: introduce a portable ifdef. NULL's bits aren't always all-zeros */
+    memset(m->buckets, 0, sizeof(*m->buckets) * m->nbuckets);
+    /* Re-add nodes to buckets */
+    node = nodes;
+    while (node != NULL) {
+        next = node->next;
+        map_addnode(m, node);
+        node = next;
     }
     /* Return error code if realloc() failed */
     return (buckets == NULL) ? 0 : 1;
 }
 
 
-static map_node_t **map_getref(map_base_t *m, const void *key, size_t ksize) {
-    size_t hash = m->hash_func(key, ksize);
+static map_node_t **map_getref(map_base_t *m, const map_lookup_t *l, size_t ksize) {
     map_node_t **next;
+    if (m->oldbuckets != NULL) {
+        map_rehash_step(m, MAP_REHASH_STEP);
+    }
     if (m->nbuckets > 0) {
-        next = &m->buckets[map_bucketidx(m, hash)];
+        next = map_bucketref(m, l->hash);
         while (*next != NULL) {
-            if ((*next)->hash == hash && m->cmp_func(key, (*next)->key, ksize) == 0) {
+            if ((*next)->hash == l->hash && MAP_KEYEQ(m, l, (*next)->key, ksize)) {
+                MAP_COUNT(m, hits);
                 return next;
             }
             next = &(*next)->next;
         }
     }
+    MAP_COUNT(m, misses);
     return NULL;
 }
 
 
-void map_delete_(map_base_t *m) {
-    map_node_t *next, *node;
-    size_t i;
-    i = m->nbuckets;
-    while (i--) {
-        node = m->buckets[i];
-        while (node != NULL) {
-            next = node->next;
-            free(node);
-            node = next;
-        }
+/*
+ * Open addressing (flat) engine.
+ * Slots live in one allocation: [slots: nbuckets * slotsize][hashes: nbuckets][ctrl: nbuckets].
+ * Each ctrl byte is either EMPTY, DELETED or the low 7 bits of the slot's hash,
+ * so a group of MAP_GROUP slots can be filtered with a single SSE2 compare
+ * before any key is touched. Groups are probed triangularly, which visits
+ * every group when the group count is a power of 2.
+ */
+
+#define MAP_CTRL_EMPTY 0x80u
+#define MAP_CTRL_DELETED 0xFEu
+#define MAP_NPOS ((size_t)-1)
+#define MAP_H1(hash) ((hash) >> 7)
+#define MAP_H2(hash) ((unsigned char)((hash) & 0x7Fu))
+#define MAP_FLAT_SLOT(m, i) ((char *)(m)->buckets + (i) * (m)->slotsize)
+
+static unsigned map_ctz(unsigned mask) {
+#if defined(__GNUC__)
+    return (unsigned) __builtin_ctz(mask);
+#else
+    unsigned n = 0;
+    while (!(mask & 1u)) {
+        mask >>= 1;
+        n++;
     }
-    free(m->buckets);
+    return n;
+#endif
 }
 
+/* Bitmask of slots in the group whose ctrl byte equals c */
+static unsigned map_group_match(const unsigned char *group, unsigned c) {
+#ifdef MAP_SSE2
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) c)));
+#else
+    unsigned mask = 0, i;
+    for (i = 0; i < MAP_GROUP; i++) {
+        mask |= (unsigned) (group[i] == c) << i;
+    }
+    return mask;
+#endif
+}
 
-void *map_get_(map_base_t *m, const void *key, size_t ksize) {
-    map_node_t **next = map_getref(m, key, ksize);
-    return next != NULL ? (*next)->value : NULL;
+/* Bitmask of EMPTY or DELETED slots in the group */
+static unsigned map_group_free(const unsigned char *group) {
+#ifdef MAP_SSE2
+    return (unsigned) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#else
+    unsigned mask = 0, i;
+    for (i = 0; i < MAP_GROUP; i++) {
+        mask |= (unsigned) (group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+static size_t map_flat_find(map_base_t *m, const map_lookup_t *l, size_t ksize) {
+    size_t gmask, g, step = 0, i, hash = l->hash;
+    unsigned match;
+    const unsigned char *group;
+    if (m->nbuckets == 0) {
+        MAP_COUNT(m, misses);
+        return MAP_NPOS;
+    }
+    gmask = m->nbuckets / MAP_GROUP - 1;
+    g = MAP_H1(hash) & gmask;
+    for (;;) {
+        group = m->ctrl + g * MAP_GROUP;
+        match = map_group_match(group, MAP_H2(hash));
+        while (match) {
+            i = g * MAP_GROUP + map_ctz(match);
+            if (m->hashes[i] == hash && MAP_KEYEQ(m, l, MAP_FLAT_SLOT(m, i), ksize)) {
+                MAP_COUNT(m, hits);
+                return i;
+            }
+            match &= match - 1;
+        }
+        if (map_group_match(group, MAP_CTRL_EMPTY)) {
+            MAP_COUNT(m, misses);
+            return MAP_NPOS;
+        }
+        g = (g + ++step) & gmask;
+    }
 }
 
+/* First EMPTY or DELETED slot in the probe sequence of hash */
+static size_t map_flat_slotfor(map_base_t *m, size_t hash) {
+    size_t gmask = m->nbuckets / MAP_GROUP - 1, g = MAP_H1(hash) & gmask, step = 0;
+    unsigned match;
+    while ((match = map_group_free(m->ctrl + g * MAP_GROUP)) == 0) {
+        g = (g + ++step) & gmask;
+    }
+    return g * MAP_GROUP + map_ctz(match);
+}
 
-int map_set_(map_base_t *m, const void *key, size_t ksize, size_t koffset, const void *value, size_t vsize, size_t voffset) {
-    size_t n;
-    map_node_t **next, *node;
-    /* Find & replace existing node */
-    next = map_getref(m, key, ksize);
-    if (next != NULL) {
-        memcpy((*next)->value, value, vsize);
-        return 1;
+/* Key at offset 0, value right after it, both aligned for their size */
+static void map_slot_layout(map_base_t *m) {
+    size_t kalign = map_sizealign(m->ksize), valign = map_sizealign(m->vsize);
+    m->slotvoff = map_roundup(m->ksize, valign);
+    m->slotsize = map_roundup(m->slotvoff + m->vsize, kalign > valign ? kalign : valign);
+    if (m->slotsize == 0) {
+        m->slotsize = 1;
     }
-    /* Add new node */
-    node = map_newnode(key, ksize, koffset, value, vsize, voffset, m->hash_func);
-    if (node == NULL) {
+}
+
+static int map_flat_resize(map_base_t *m, size_t nslots) {
+    map_base_t old = *m;
+    size_t i, j;
+    char *mem;
+    if (m->slotsize == 0) {
+        map_slot_layout(m);
+    }
+    /* nslots is a multiple of MAP_GROUP, so the hashes that follow slots stay aligned */
+    mem = (char *) map_malloc(m, nslots * (m->slotsize + sizeof(*m->hashes) + 1));
+    if (mem == NULL) {
         return 0;
     }
-    if (m->nnodes >= m->nbuckets) {
-        n = (m->nbuckets > 0) ? (m->nbuckets * 2) : 1;
-        if (!map_resize(m, n)) {
-            free(node);
-            return 0;
+    m->buckets = (map_node_t **) mem;
+    m->hashes = (size_t *) (mem + nslots * m->slotsize);
+    m->ctrl = (unsigned char *) (m->hashes + nslots);
+    m->nbuckets = nslots;
+    m->ntombs = 0;
+    map_setlimits(m);
+    memset(m->ctrl, MAP_CTRL_EMPTY, nslots);
+    /* Re-add entries using their stored hashes */
+    for (i = 0; i < old.nbuckets; i++) {
+        if (old.ctrl[i] & MAP_CTRL_EMPTY) {
+            continue;
         }
+        j = map_flat_slotfor(m, old.hashes[i]);
+        m->ctrl[j] = old.ctrl[i];
+        m->hashes[j] = old.hashes[i];
+        memcpy(MAP_FLAT_SLOT(m, j), MAP_FLAT_SLOT(&old, i), m->slotsize);
     }
-    map_addnode(m, node);
-    m->nnodes++;
+    map_free(m, old.buckets);
     return 1;
 }
 
+static void *map_flat_get(map_base_t *m, const map_lookup_t *l, size_t ksize) {
+    size_t i = map_flat_find(m, l, ksize);
+    return i != MAP_NPOS ? MAP_FLAT_SLOT(m, i) + m->slotvoff : NULL;
+}
 
-void map_remove_(map_base_t *m, const void *key, size_t ksize) {
-    map_node_t *node;
-    map_node_t **next = map_getref(m, key, ksize);
-    if (next != NULL) {
-        node = *next;
-        *next = (*next)->next;
-        free(node);
-        m->nnodes--;
+static void *map_flat_insert(map_base_t *m, const map_lookup_t *l, const void *key, size_t ksize, const void *value, size_t vsize, int *inserted) {
+    size_t hash = l->hash, i, n;
+    char *slot, *str = NULL;
+    i = map_flat_find(m, l, ksize);
+    if (i != MAP_NPOS) {
+        *inserted = 0;
+        return MAP_FLAT_SLOT(m, i) + m->slotvoff;
+    }
+    if (m->nnodes + m->ntombs >= m->growat) {
+        /* Grow if mostly full, otherwise rehash in place to drop tombstones */
+        if (m->nbuckets == 0) {
+            n = map_nbuckets_for(m, 1);
+        } else {
+            n = (m->nnodes >= m->growat / 2) ? m->nbuckets * 2 : m->nbuckets;
+        }
+        if (!MAP_RESIZE(m, map_flat_resize, n)) {
+            return NULL;
+        }
+    }
+    if (m->flags & MAP_STRKEYS_) {
+        str = (char *) map_malloc(m, map_strkey_size(&l->str));
+        if (str == NULL) {
+            return NULL;
+        }
+        str = map_strkey_init(str, &l->str);
+    }
+    i = map_flat_slotfor(m, hash);
+    if (m->ctrl[i] == MAP_CTRL_DELETED) {
+        m->ntombs--;
+    }
+    m->ctrl[i] = MAP_H2(hash);
+    m->hashes[i] = hash;
+    slot = MAP_FLAT_SLOT(m, i);
+    if (str != NULL) {
+        *(char **) slot = str;
+    } else {
+        memcpy(slot, key, ksize);
     }
+    memcpy(slot + m->slotvoff, value, vsize);
+    m->nnodes++;
+    *inserted = 1;
+    return slot + m->slotvoff;
 }
 
+static void map_flat_erase(map_base_t *m, size_t i) {
+    if (m->flags & MAP_STRKEYS_) {
+        map_free(m, map_strkey_block(MAP_FLAT_SLOT(m, i)));
+    }
+    /* A group with an EMPTY slot ends every probe sequence reaching it,
+     * so the slot can become EMPTY again instead of a tombstone */
+    if (map_group_match(m->ctrl + i / MAP_GROUP * MAP_GROUP, MAP_CTRL_EMPTY)) {
+        m->ctrl[i] = MAP_CTRL_EMPTY;
+    } else {
+        m->ctrl[i] = MAP_CTRL_DELETED;
+        m->ntombs++;
+    }
+    m->nnodes--;
+}
 
-map_iter_t map_iter_(void) {
-    map_iter_t iter;
-    iter.bucketidx = (size_t)-1;
-    iter.node = NULL;
-    return iter;
+static void map_flat_remove(map_base_t *m, const map_lookup_t *l, size_t ksize) {
+    size_t i = map_flat_find(m, l, ksize);
+    if (i != MAP_NPOS) {
+        map_flat_erase(m, i);
+    }
 }
 
+/* Where an iterator over n positions stops */
+static size_t map_iter_stop(const map_iter_t *iter, size_t n) {
+    return (iter->end < n) ? iter->end : n;
+}
 
-void *map_next_(map_base_t *m, map_iter_t *iter) {
-    if (iter->node != NULL) {
-        iter->node = iter->node->next;
-        if (iter->node == NULL) {
-            goto nextBucket;
+static void *map_flat_next(map_base_t *m, map_iter_t *iter) {
+    size_t stop = map_iter_stop(iter, m->nbuckets);
+    while (++iter->bucketidx < stop) {
+        if (!(m->ctrl[iter->bucketidx] & MAP_CTRL_EMPTY)) {
+            return MAP_FLAT_SLOT(m, iter->bucketidx);
         }
-    } else {
-        nextBucket:
-        do {
-            if (++iter->bucketidx >= m->nbuckets) {
-                return NULL;
-            }
-            iter->node = m->buckets[iter->bucketidx];
-        } while (iter->node == NULL);
     }
-    return iter->node->key;
+    return NULL;
 }
 
 
-int map_equal_(map_base_t *m1, map_base_t *m2, size_t ksize, size_t vsize, MapCmpFunction val_cmp_func) {
-    void *m1_key;
-    map_iter_t m1_it = map_iter(m1);
-    if (m1->nnodes != m2->nnodes){
-        return 0;
+/*
+ * Dense engine, see map_init_dense.
+ * Entries are appended in insertion order to one array of [hash, index slot, key, value]
+ * records, and buckets is a linear probing index of entry numbers + 1, 0 being empty.
+ * Removing an entry only marks it and its index slot dead, so iterators stay valid;
+ * dead entries are squeezed out when the array fills up or is mostly dead, so
+ * iterating costs in proportion to the live entries.
+ * Cache maps put a CLOCK reference word after the index slot, see map_init_cache.
+ * Small maps keep their first entries in a buffer inside the map_t with no index, searched
+ * linearly, and move them to the heap when it fills up, see map_init_small.
+ */
+
+#define MAP_DENSE_DEAD MAP_NPOS
+#define MAP_DENSE_INDEX(m) ((size_t *) (m)->buckets)
+#define MAP_DENSE_ENTRY(m, i) ((m)->entries + (i) * (m)->entsize)
+#define MAP_DENSE_HASH(e) (((size_t *) (void *) (e))[0])
+#define MAP_DENSE_SLOT(e) (((size_t *) (void *) (e))[1])
+#define MAP_CACHE_REF(e) (((size_t *) (void *) (e))[2])
+
+static void map_dense_layout(map_base_t *m) {
+    size_t kalign = map_sizealign(m->ksize), valign = map_sizealign(m->vsize), align = sizeof(size_t);
+    align = (kalign > align) ? kalign : align;
+    align = (valign > align) ? valign : align;
+    m->entkoff = map_roundup(((m->flags & MAP_CACHE_) ? 3 : 2) * sizeof(size_t), kalign);
+    m->entvoff = map_roundup(m->entkoff + m->ksize, valign);
+    m->entsize = map_roundup(m->entvoff + m->vsize, align);
+}
+
+/* Number of the key's entry, or MAP_NPOS */
+static size_t map_dense_find(map_base_t *m, const map_lookup_t *l, size_t ksize) {
+    size_t mask = m->nbuckets - 1, i, v;
+    char *e;
+    if (m->nbuckets == 0) {
+        /* No index: empty, or the inline entries of a small map */
+        for (v = 0; v < m->nentries; v++) {
+            e = MAP_DENSE_ENTRY(m, v);
+            if (MAP_DENSE_HASH(e) == l->hash && MAP_DENSE_SLOT(e) != MAP_DENSE_DEAD && MAP_KEYEQ(m, l, e + m->entkoff, ksize)) {
+                MAP_CACHE_COUNT(m, hits);
+                return v;
+            }
+        }
+        MAP_CACHE_COUNT(m, misses);
+        return MAP_NPOS;
     }
-    if (!val_cmp_func) val_cmp_func = map_generic_cmp;
-    while ((m1_key = map_next_(m1, &m1_it)) != 0){
-        void *m2_val_ptr = map_get_(m2, m1_key, ksize);
-        if (m2_val_ptr == NULL || val_cmp_func(map_get_(m1, m1_key, ksize), m2_val_ptr, vsize) != 0){
-            return 0;
+    for (i = l->hash & mask; (v = MAP_DENSE_INDEX(m)[i]) != 0; i = (i + 1) & mask) {
+        if (v == MAP_DENSE_DEAD) {
+            continue;
+        }
+        e = MAP_DENSE_ENTRY(m, v - 1);
+        if (MAP_DENSE_HASH(e) == l->hash && MAP_KEYEQ(m, l, e + m->entkoff, ksize)) {
+            MAP_CACHE_COUNT(m, hits);
+            if (m->flags & MAP_CACHE_) {
+                MAP_CACHE_REF(e) = 1;
+            }
+            return v - 1;
         }
     }
-    return 1;
+    MAP_CACHE_COUNT(m, misses);
+    return MAP_NPOS;
 }
 
-int map_from_pairs_(map_base_t *m, size_t pcount, size_t psize,
-                    const void *key, size_t ksize, size_t koffset,
-                    const void *val, size_t vsize, size_t voffset) {
-    size_t i;
+/* First index slot for the hash that's empty or dead */
+static size_t map_dense_slotfor(map_base_t *m, size_t hash) {
+    size_t mask = m->nbuckets - 1, i = hash & mask;
+    while (MAP_DENSE_INDEX(m)[i] != 0 && MAP_DENSE_INDEX(m)[i] != MAP_DENSE_DEAD) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/* Rebuilds the index with nslots slots, squeezing the dead entries out */
+static int map_dense_resize(map_base_t *m, size_t nslots) {
+    size_t cap, i, j, hand = 0, *index;
+    int inlined = MAP_INLINED(m);
+    char *entries, *e;
+    if (m->entsize == 0) {
+        map_dense_layout(m);
+    }
+    /* A lowered load factor must not leave the array too small for the live entries and one more */
+    while ((cap = map_capacity(m, nslots)) <= m->nnodes) {
+        nslots *= 2;
+    }
+    if ((index = (size_t *) map_malloc(m, nslots * sizeof(*index))) == NULL) {
+        return 0;
+    }
+    if (cap > m->entcap || inlined) {
+        /* Inline entries are only ever left for a larger heap array */
+        entries = (char *) (inlined ? map_malloc(m, cap * m->entsize) : map_realloc(m, m->entries, cap * m->entsize));
+        if (entries == NULL) {
+            map_free(m, index);
+            return 0;
+        }
+        if (inlined) {
+            memcpy(entries, m->entries, m->nentries * m->entsize);
+        }
+        m->entries = entries;
+        m->entcap = cap;
+    }
+    memset(index, 0, nslots * sizeof(*index));
+    map_free(m, m->buckets);
+    m->buckets = (map_node_t **) index;
+    m->nbuckets = nslots;
+    for (i = j = 0; i < m->nentries; i++) {
+        e = MAP_DENSE_ENTRY(m, i);
+        if (i == m->hand) {
+            /* The CLOCK hand stays on the same entry, or the next live one */
+            hand = j;
+        }
+        if (MAP_DENSE_SLOT(e) == MAP_DENSE_DEAD) {
+            continue;
+        }
+        if (i != j) {
+            memcpy(MAP_DENSE_ENTRY(m, j), e, m->entsize);
+            e = MAP_DENSE_ENTRY(m, j);
+        }
+        MAP_DENSE_SLOT(e) = map_dense_slotfor(m, MAP_DENSE_HASH(e));
+        index[MAP_DENSE_SLOT(e)] = ++j;
+    }
+    m->nentries = j;
+    m->hand = hand;
+    if (cap < m->entcap && (entries = (char *) map_realloc(m, m->entries, cap * m->entsize)) != NULL) {
+        /* Failing to give memory back is harmless */
+        m->entries = entries;
+        m->entcap = cap;
+    }
+    map_setlimits(m);
+    return 1;
+}
+
+static void *map_dense_get(map_base_t *m, const map_lookup_t *l, size_t ksize) {
+    size_t i = map_dense_find(m, l, ksize);
+    return (i != MAP_NPOS) ? MAP_DENSE_ENTRY(m, i) + m->entvoff : NULL;
+}
+
+/* Marks entry i and its index slot dead, nothing moves */
+static void map_dense_erase(map_base_t *m, size_t i) {
+    char *e = MAP_DENSE_ENTRY(m, i);
+    if (m->flags & MAP_STRKEYS_) {
+        map_free(m, map_strkey_block(e + m->entkoff));
+    }
+    if (m->nbuckets > 0) {
+        MAP_DENSE_INDEX(m)[MAP_DENSE_SLOT(e)] = MAP_DENSE_DEAD;
+    }
+    MAP_DENSE_SLOT(e) = MAP_DENSE_DEAD;
+    m->nnodes--;
+}
+
+/* Moves the live inline entries of a small map to the front of its buffer */
+static void map_small_squeeze(map_base_t *m) {
+    size_t i, j;
+    for (i = j = 0; i < m->nentries; i++) {
+        if (MAP_DENSE_SLOT(MAP_DENSE_ENTRY(m, i)) == MAP_DENSE_DEAD) {
+            continue;
+        }
+        if (i != j) {
+            memcpy(MAP_DENSE_ENTRY(m, j), MAP_DENSE_ENTRY(m, i), m->entsize);
+        }
+        j++;
+    }
+    m->nentries = j;
+}
+
+/*
+ * CLOCK eviction: the hand sweeps the entries in insertion order, sparing and unmarking
+ * those looked up since it last passed, and evicts the first one that wasn't
+ */
+static void map_cache_evict(map_base_t *m) {
+    char *e;
+    for (;;) {
+        if (m->hand >= m->nentries) {
+            m->hand = 0;
+        }
+        e = MAP_DENSE_ENTRY(m, m->hand);
+        if (MAP_DENSE_SLOT(e) == MAP_DENSE_DEAD) {
+            m->hand++;
+            continue;
+        }
+        if (MAP_CACHE_REF(e)) {
+            MAP_CACHE_REF(e) = 0;
+            m->hand++;
+            continue;
+        }
+        if (m->evict_func != NULL) {
+            m->evict_func(e + m->entkoff, e + m->entvoff, m->evict_udata);
+        }
+        map_dense_erase(m, m->hand++);
+        m->counters.evictions++;
+        return;
+    }
+}
+
+static void *map_dense_insert(map_base_t *m, const map_lookup_t *l, const void *key, size_t ksize, const void *value, size_t vsize, int *inserted) {
+    size_t i = map_dense_find(m, l, ksize), n;
+    char *e, *str = NULL;
+    if (i != MAP_NPOS) {
+        *inserted = 0;
+        return MAP_DENSE_ENTRY(m, i) + m->entvoff;
+    }
+    if ((m->flags & MAP_CACHE_) && m->nnodes >= m->maxentries && m->nnodes > 0) {
+        map_cache_evict(m);
+    }
+    if (MAP_INLINED(m)) {
+        /* Reuse dead inline entries first, spill to the heap when all of them are live */
+        if (m->nentries >= m->entcap && m->nnodes < m->entcap) {
+            map_small_squeeze(m);
+        } else if (m->nentries >= m->entcap && !MAP_RESIZE(m, map_dense_resize, map_nbuckets_for(m, m->nnodes + 1))) {
+            return NULL;
+        }
+    } else if (m->nentries >= m->growat || m->nentries >= m->entcap) {
+        /* Grow if mostly live, otherwise squeeze out the dead entries in place */
+        if (m->nbuckets == 0) {
+            n = map_nbuckets_for(m, 1);
+        } else {
+            n = (m->nnodes >= m->growat / 2) ? m->nbuckets * 2 : m->nbuckets;
+        }
+        if (!MAP_RESIZE(m, map_dense_resize, n)) {
+            return NULL;
+        }
+    }
+    if (m->flags & MAP_STRKEYS_) {
+        str = (char *) map_malloc(m, map_strkey_size(&l->str));
+        if (str == NULL) {
+            return NULL;
+        }
+        str = map_strkey_init(str, &l->str);
+    }
+    e = MAP_DENSE_ENTRY(m, m->nentries++);
+    if (m->nbuckets > 0) {
+        i = map_dense_slotfor(m, l->hash);
+        MAP_DENSE_INDEX(m)[i] = m->nentries;
+    } else {
+        i = 0;
+    }
+    MAP_DENSE_HASH(e) = l->hash;
+    MAP_DENSE_SLOT(e) = i;
+    if (m->flags & MAP_CACHE_) {
+        MAP_CACHE_REF(e) = 0;
+    }
+    if (str != NULL) {
+        *(char **) (e + m->entkoff) = str;
+    } else {
+        memcpy(e + m->entkoff, key, ksize);
+    }
+    memcpy(e + m->entvoff, value, vsize);
+    m->nnodes++;
+    *inserted = 1;
+    return e + m->entvoff;
+}
+
+static void map_dense_remove(map_base_t *m, const map_lookup_t *l, size_t ksize) {
+    size_t i = map_dense_find(m, l, ksize);
+    if (i == MAP_NPOS) {
+        return;
+    }
+    map_dense_erase(m, i);
+    if (m->nbuckets > 0 && m->nentries - m->nnodes > m->nnodes && m->nentries - m->nnodes >= 16) {
+        /* Mostly dead, failing to compact only costs iteration time */
+        MAP_RESIZE(m, map_dense_resize, m->nbuckets);
+    }
+}
+
+static void *map_dense_next(map_base_t *m, map_iter_t *iter) {
+    char *e;
+    size_t stop = map_iter_stop(iter, m->nentries);
+    while (++iter->bucketidx < stop) {
+        e = MAP_DENSE_ENTRY(m, iter->bucketidx);
+        if (MAP_DENSE_SLOT(e) != MAP_DENSE_DEAD) {
+            return e + m->entkoff;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Frozen engine, see map_freeze.
+ * The entries are packed into exactly nnodes slots, laid out like flat slots, and
+ * placed with a CHD minimal perfect hash. A key's hash picks one of ndisps
+ * displacements and two positions f1 and f2, and the displacement (d0, d1) puts the
+ * key in slot (f1 + d0 * f2 + d1) mod nnodes. So a lookup is one displacement read,
+ * one slot read and one compare.
+ * One allocation holds [slots][displacements][owned strings].
+ */
+
+#define MAP_CHD_LAMBDA 4
+#define MAP_CHD_SEEDS 8
+/* d0 lives in the top 8 bits of a displacement, d1 below */
+#define MAP_CHD_D0SHIFT (sizeof(size_t) * 8 - 8)
+#define MAP_CHD_D1MASK (((size_t) 1 << MAP_CHD_D0SHIFT) - 1)
+#define MAP_CHD_D0MAX 256u
+
+typedef struct {
+    size_t bucket, f1, f2;
+} map_chd_t;
+
+/* Scratch space of map_chd_build */
+typedef struct {
+    map_chd_t *chd;       /* per entry */
+    size_t *start;        /* per displacement + 1, where its entries begin in members */
+    size_t *members;      /* entries grouped by displacement */
+    size_t *order;        /* displacements, most entries first */
+    unsigned char *taken; /* per slot */
+} map_chd_work_t;
+
+static void map_chd_hash(size_t hash, size_t nslots, size_t ndisps, map_chd_t *c) {
+    size_t x = map_hash_mix(hash), y = map_hash_mix(x ^ MAP_K(0x9E3779B9UL, 0x7F4A7C15UL));
+    c->bucket = x % ndisps;
+    c->f1 = y % nslots;
+    c->f2 = map_hash_mix(y) % nslots;
+}
+
+static size_t map_chd_slot(const map_chd_t *c, size_t disp, size_t nslots) {
+    /* No overflow: d0 < 2^8 and f2, d1 < nslots <= 2^(bits - 8) */
+    return (c->f1 + (disp >> MAP_CHD_D0SHIFT) * c->f2 % nslots + (disp & MAP_CHD_D1MASK)) % nslots;
+}
+
+/* Puts the entries of a displacement in free slots, or leaves taken as it was */
+static int map_chd_place(map_chd_work_t *w, const size_t *members, size_t count, size_t disp, size_t nslots, size_t *pos) {
+    size_t i, p;
+    for (i = 0; i < count; i++) {
+        p = map_chd_slot(&w->chd[members[i]], disp, nslots);
+        if (w->taken[p]) {
+            break;
+        }
+        w->taken[p] = 1;
+        pos[members[i]] = p;
+    }
+    if (i == count) {
+        return 1;
+    }
+    while (i--) {
+        w->taken[pos[members[i]]] = 0;
+    }
+    return 0;
+}
+
+/* Finds the displacements and the slot of each entry, 0 if it doesn't work out for these hashes */
+static int map_chd_build(map_chd_work_t *w, const size_t *hashes, size_t n, size_t ndisps, size_t *disps, size_t *pos) {
+    size_t i, j, b, size, maxsize = 0, norder = 0, d0, d1, freeslot = 0;
+    const size_t *members;
+    for (b = 0; b <= ndisps; b++) {
+        w->start[b] = 0;
+    }
+    for (i = 0; i < n; i++) {
+        map_chd_hash(hashes[i], n, ndisps, &w->chd[i]);
+        w->start[w->chd[i].bucket + 1]++;
+    }
+    for (b = 0; b < ndisps; b++) {
+        w->start[b + 1] += w->start[b];
+        w->order[b] = w->start[b];
+    }
+    for (i = 0; i < n; i++) {
+        w->members[w->order[w->chd[i].bucket]++] = i;
+    }
+    for (b = 0; b < ndisps; b++) {
+        size = w->start[b + 1] - w->start[b];
+        maxsize = (size > maxsize) ? size : maxsize;
+    }
+    for (size = maxsize; size > 0; size--) {
+        for (b = 0; b < ndisps; b++) {
+            if (w->start[b + 1] - w->start[b] == size) {
+                w->order[norder++] = b;
+            }
+        }
+    }
+    memset(w->taken, 0, n);
+    for (b = 0; b < ndisps; b++) {
+        disps[b] = 0;
+    }
+    for (i = 0; i < norder; i++) {
+        b = w->order[i];
+        members = w->members + w->start[b];
+        size = w->start[b + 1] - w->start[b];
+        if (size == 1) {
+            /* Any free slot will do, the rest are all singles too */
+            while (w->taken[freeslot]) {
+                freeslot++;
+            }
+            disps[b] = (freeslot + n - w->chd[members[0]].f1) % n;
+            w->taken[freeslot] = 1;
+            pos[members[0]] = freeslot;
+            continue;
+        }
+        for (j = 1; j < size; j++) {
+            if (hashes[members[j]] == hashes[members[0]]) {
+                /* Equal hashes land on the same slot whatever the seed */
+                return 0;
+            }
+        }
+        for (d0 = 0; d0 < MAP_CHD_D0MAX; d0++) {
+            for (d1 = 0; d1 < n; d1++) {
+                if (map_chd_place(w, members, size, (d0 << MAP_CHD_D0SHIFT) | d1, n, pos)) {
+                    disps[b] = (d0 << MAP_CHD_D0SHIFT) | d1;
+                    goto placed;
+                }
+            }
+        }
+        return 0;
+        placed:;
+    }
+    return 1;
+}
+
+static size_t map_frozen_slot(map_base_t *m, size_t hash) {
+    map_chd_t c;
+    map_chd_hash(hash, m->nbuckets, m->ndisps, &c);
+    return map_chd_slot(&c, m->disps[c.bucket], m->nbuckets);
+}
+
+static void *map_frozen_get(map_base_t *m, const map_lookup_t *l, size_t ksize) {
+    char *slot;
+    if (m->nbuckets == 0) {
+        MAP_COUNT(m, misses);
+        return NULL;
+    }
+    slot = MAP_FLAT_SLOT(m, map_frozen_slot(m, l->hash));
+    MAP_COUNT(m, comparisons);
+    /* Plain keys skip the indirect call */
+    if ((l->cmp == map_generic_cmp) ? memcmp(l->key, slot, ksize) : l->cmp(l->key, slot, ksize)) {
+        MAP_COUNT(m, misses);
+        return NULL;
+    }
+    MAP_COUNT(m, hits);
+    return slot + m->slotvoff;
+}
+
+static void *map_frozen_next(map_base_t *m, map_iter_t *iter) {
+    return (++iter->bucketidx < map_iter_stop(iter, m->nbuckets)) ? MAP_FLAT_SLOT(m, iter->bucketidx) : NULL;
+}
+
+
+/*
+ * Images, see map_save.
+ * A MAP_IMAGE_HDR byte header followed by the slots and displacements of a frozen
+ * map, exactly as they are in memory. Only plain keys and values are saved, so the
+ * image has no pointers and can be used wherever it's mapped. Files are only read
+ * by builds with the same size_t, which the byte order marker also checks.
+ */
+
+#define MAP_IMAGE_MAGIC "cmapimg"
+#define MAP_IMAGE_VERSION 1
+#define MAP_IMAGE_HDR 128
+
+typedef struct {
+    char magic[8];
+    size_t version, order;
+    size_t ksize, vsize, slotsize, slotvoff;
+    size_t nnodes, ndisps, pseed;
+    size_t datasize, datasum;
+    /* checksum of the fields above */
+    size_t hdrsum;
+} map_image_t;
+
+#define MAP_IMAGE_ORDER MAP_K(0x01020304UL, 0x05060708UL)
+
+static size_t map_image_hdrsum(const map_image_t *hdr) {
+    return map_fast_hash_seeded(hdr, (size_t) ((const char *) &hdr->hdrsum - (const char *) hdr), 0);
+}
+
+/* Read-only view of a whole file, mapped where possible */
+static char *map_mapfile(map_base_t *m, const char *path, size_t *size) {
+#ifdef MAP_MMAP
+    struct stat st;
+    void *data;
+    int fd = open(path, O_RDONLY);
+    (void) m;
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t) st.st_size;
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return (data != MAP_FAILED) ? (char *) data : NULL;
+#else
+    FILE *f = fopen(path, "rb");
+    long len;
+    char *data = NULL;
+    if (f == NULL) {
+        return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        *size = (size_t) len;
+        if ((data = (char *) map_malloc(m, *size)) != NULL && fread(data, 1, *size, f) != *size) {
+            map_free(m, data);
+            data = NULL;
+        }
+    }
+    fclose(f);
+    return data;
+#endif
+}
+
+static void map_unmapfile(map_base_t *m, void *data, size_t size) {
+#ifdef MAP_MMAP
+    (void) m;
+    munmap(data, size);
+#else
+    (void) size;
+    map_free(m, data);
+#endif
+}
+
+/* Value of the entry map_next_ has just returned the key of */
+static void *map_iter_value(map_base_t *m, map_iter_t *iter) {
+    if (m->flags & (MAP_FLAT_ | MAP_FROZEN_)) {
+        return MAP_FLAT_SLOT(m, iter->bucketidx) + m->slotvoff;
+    }
+    if (m->flags & MAP_DENSE_) {
+        return MAP_DENSE_ENTRY(m, iter->bucketidx) + m->entvoff;
+    }
+    return iter->node->value;
+}
+
+/* Hash the current entry was stored with, frozen maps don't keep it */
+static size_t map_iter_hash(map_base_t *m, map_iter_t *iter) {
+    if (m->flags & MAP_FLAT_) {
+        return m->hashes[iter->bucketidx];
+    }
+    if (m->flags & MAP_DENSE_) {
+        return MAP_DENSE_HASH(MAP_DENSE_ENTRY(m, iter->bucketidx));
+    }
+    return iter->node->hash;
+}
+
+/* Whether a hash stored by m1 is what m2 would compute for the key */
+static int map_samehash(map_base_t *m1, map_base_t *m2) {
+    return !((m1->flags | m2->flags) & MAP_FROZEN_) && m1->hash_func == m2->hash_func
+        && m1->seed_hash_func == m2->seed_hash_func && (m1->seed_hash_func == NULL || m1->seed == m2->seed);
+}
+
+
+static void map_freechains(map_base_t *m, map_node_t **buckets, size_t from, size_t to) {
+    map_node_t *next, *node;
+    while (from < to) {
+        node = buckets[from++];
+        while (node != NULL) {
+            next = node->next;
+            map_free(m, node);
+            node = next;
+        }
+    }
+}
+
+
+void map_delete_(map_base_t *m) {
+    void *chunk;
+    size_t i;
+    if (m->flags & MAP_FROZEN_) {
+        /* Everything is in the one block, the map goes back to its engine */
+        if (m->flags & MAP_MAPPED_) {
+            map_unmapfile(m, m->mapping, m->mapsize);
+            m->buckets = NULL;
+            m->mapping = NULL;
+            m->mapsize = 0;
+        }
+        m->flags &= ~(MAP_FROZEN_ | MAP_MAPPED_);
+        m->disps = NULL;
+        m->ndisps = 0;
+    } else if ((m->flags & MAP_FLAT_) && (m->flags & MAP_STRKEYS_)) {
+        for (i = 0; i < m->nbuckets; i++) {
+            if (!(m->ctrl[i] & MAP_CTRL_EMPTY)) {
+                map_free(m, map_strkey_block(MAP_FLAT_SLOT(m, i)));
+            }
+        }
+    } else if ((m->flags & MAP_DENSE_) && (m->flags & MAP_STRKEYS_)) {
+        for (i = 0; i < m->nentries; i++) {
+            if (MAP_DENSE_SLOT(MAP_DENSE_ENTRY(m, i)) != MAP_DENSE_DEAD) {
+                map_free(m, map_strkey_block(MAP_DENSE_ENTRY(m, i) + m->entkoff));
+            }
+        }
+    } else if (!(m->flags & (MAP_FLAT_ | MAP_DENSE_)) && !MAP_POOLED(m)) {
+        map_freechains(m, m->buckets, 0, m->nbuckets);
+        if (m->oldbuckets != NULL) {
+            map_freechains(m, m->oldbuckets, m->migrated, m->noldbuckets);
+        }
+    }
+    /* Pooled nodes are released a chunk at a time */
+    while (m->pool_chunks != NULL) {
+        chunk = m->pool_chunks;
+        m->pool_chunks = *(void **) chunk;
+        map_free(m, chunk);
+    }
+    m->pool_free = NULL;
+    map_free(m, m->buckets);
+    map_free(m, m->oldbuckets);
+    if (!MAP_INLINED(m)) {
+        map_free(m, m->entries);
+    }
+    m->entries = NULL;
+    m->nentries = 0;
+    m->hand = 0;
+    m->entcap = m->smallcap;
+    m->buckets = NULL;
+    m->nbuckets = 0;
+    m->nnodes = 0;
+    m->oldbuckets = NULL;
+    m->noldbuckets = 0;
+    m->migrated = 0;
+    m->ntombs = 0;
+    m->hashes = NULL;
+    m->ctrl = NULL;
+    map_setlimits(m);
+}
+
+
+/* Resize to nbuckets if that's fewer than now, releasing everything if the map is empty */
+static int map_shrink(map_base_t *m, size_t nbuckets) {
+    if (m->flags & MAP_FROZEN_) {
+        return 1;
+    }
+    if (m->nnodes == 0) {
+        map_delete_(m);
+        return 1;
+    }
+    if (nbuckets >= m->nbuckets) {
+        return 1;
+    }
+    if (m->flags & MAP_FLAT_) {
+        return MAP_RESIZE(m, map_flat_resize, nbuckets);
+    }
+    if (m->flags & MAP_DENSE_) {
+        return MAP_RESIZE(m, map_dense_resize, nbuckets);
+    }
+    return (m->flags & MAP_INCREMENTAL_) ? MAP_RESIZE(m, map_resize_incremental, nbuckets) : MAP_RESIZE(m, map_resize, nbuckets);
+}
+
+int map_reserve_(map_base_t *m, size_t nentries) {
+    size_t n = map_nbuckets_for(m, nentries);
+    if (m->flags & MAP_FROZEN_) {
+        return nentries <= m->nnodes;
+    }
+    if (n <= m->nbuckets || (MAP_INLINED(m) && nentries <= m->smallcap)) {
+        return 1;
+    }
+    if (m->flags & MAP_DENSE_) {
+        map_small_sync(m);
+        return MAP_RESIZE(m, map_dense_resize, n);
+    }
+    return (m->flags & MAP_FLAT_) ? MAP_RESIZE(m, map_flat_resize, n) : MAP_RESIZE(m, map_resize, n);
+}
+
+int map_shrink_to_fit_(map_base_t *m) {
+    return map_shrink(m, map_nbuckets_for(m, m->nnodes));
+}
+
+void map_load_factor_(map_base_t *m, float maxload, float minload) {
+    if (maxload > 0) {
+        m->maxload = maxload;
+    }
+    /* Shrinking to fit must not immediately qualify for another shrink */
+    m->minload = (minload < m->maxload / 2) ? minload : m->maxload / 2;
+    map_setlimits(m);
+}
+
+
+static void map_stats_tally(map_stats_t *st, size_t probes) {
+    st->probes[(probes < MAP_STATS_NPROBES) ? probes - 1 : MAP_STATS_NPROBES - 1]++;
+    st->max_probe = (probes > st->max_probe) ? probes : st->max_probe;
+    st->avg_probe += (double) probes;
+}
+
+/* Bytes of the owned copy of a string key */
+static size_t map_stats_strkey(map_base_t *m, const void *stored) {
+    return (m->flags & MAP_STRKEYS_) ? sizeof(size_t) + MAP_STRLEN(*(char * const *) stored) + 1 : 0;
+}
+
+void map_stats_(map_base_t *m, map_stats_t *st) {
+    size_t i, probes, mask, gmask, g;
+    map_node_t *node;
+    char *e;
+    memset(st, 0, sizeof(*st));
+    map_small_sync(m);
+    st->nnodes = m->nnodes;
+    st->nbuckets = m->nbuckets;
+    st->load_factor = (m->nbuckets > 0) ? (double) m->nnodes / (double) m->nbuckets : 0;
+    if (m->flags & MAP_FROZEN_) {
+        /* Every key is one probe away */
+        for (i = 0; i < m->nbuckets; i++) {
+            map_stats_tally(st, 1);
+            st->node_bytes += m->slotsize + map_stats_strkey(m, MAP_FLAT_SLOT(m, i));
+        }
+        st->bucket_bytes = m->ndisps * sizeof(*m->disps);
+    } else if (m->flags & MAP_FLAT_) {
+        gmask = m->nbuckets / MAP_GROUP - 1;
+        for (i = 0; i < m->nbuckets; i++) {
+            if (m->ctrl[i] & MAP_CTRL_EMPTY) {
+                continue;
+            }
+            /* Replay the probe sequence up to the slot's group */
+            g = MAP_H1(m->hashes[i]) & gmask;
+            for (probes = 1; g != i / MAP_GROUP; probes++) {
+                g = (g + probes) & gmask;
+            }
+            map_stats_tally(st, probes);
+            st->node_bytes += map_stats_strkey(m, MAP_FLAT_SLOT(m, i));
+        }
+        st->bucket_bytes = m->nbuckets * (sizeof(*m->hashes) + 1);
+        st->node_bytes += m->nbuckets * m->slotsize;
+    } else if (m->flags & MAP_DENSE_) {
+        mask = m->nbuckets - 1;
+        for (i = 0; i < m->nentries; i++) {
+            e = MAP_DENSE_ENTRY(m, i);
+            if (MAP_DENSE_SLOT(e) != MAP_DENSE_DEAD) {
+                /* inline entries are searched from the first one */
+                map_stats_tally(st, (m->nbuckets > 0) ? ((MAP_DENSE_SLOT(e) - MAP_DENSE_HASH(e)) & mask) + 1 : i + 1);
+                st->node_bytes += map_stats_strkey(m, e + m->entkoff);
+            }
+        }
+        st->bucket_bytes = m->nbuckets * sizeof(size_t);
+        st->node_bytes += MAP_INLINED(m) ? 0 : m->entcap * m->entsize;
+    } else {
+        for (i = 0; i < m->nbuckets + m->noldbuckets; i++) {
+            /* Old buckets below migrated were moved already */
+            node = (i < m->nbuckets) ? m->buckets[i]
+                 : (i - m->nbuckets >= m->migrated) ? m->oldbuckets[i - m->nbuckets] : NULL;
+            for (probes = 1; node != NULL; node = node->next, probes++) {
+                map_stats_tally(st, probes);
+                st->node_bytes += (size_t) ((char *) node->value + m->vsize - (char *) node);
+                st->node_bytes += map_stats_strkey(m, node->key);
+            }
+        }
+        st->bucket_bytes = (m->nbuckets + m->noldbuckets) * sizeof(*m->buckets);
+    }
+    st->avg_probe = (m->nnodes > 0) ? st->avg_probe / (double) m->nnodes : 0;
+#ifdef MAP_STATS
+    st->counting = 1;
+#endif
+    st->counters = m->counters;
+    st->lookups = m->counters.hits + m->counters.misses;
+}
+
+
+/* Frozen storage holding the entries of the map, sets the displacement count and seed it used */
+static char *map_frozen_build(map_base_t *m, size_t *ndisps_out, size_t *seed_out) {
+    map_iter_t it = map_iter_();
+    map_chd_work_t w;
+    map_slice_t str;
+    size_t n = m->nnodes, ndisps = n / MAP_CHD_LAMBDA + 1, slotbytes, strbytes = 0, seed = 0, i, tries;
+    size_t *hashes, *pos, *disps;
+    const void **entries;
+    char *mem, *work, *slot, *strmem;
+    int built = (n == 0);
+    if (n > MAP_CHD_D1MASK) {
+        return NULL;
+    }
+    /* entries ends with the NULL from the last map_next_ */
+    work = (char *) map_malloc(m, n * (3 * sizeof(size_t) + sizeof(map_chd_t) + 2 * sizeof(void *) + 1) +
+                                  (2 * ndisps + 1) * sizeof(size_t) + sizeof(void *));
+    if (work == NULL) {
+        return NULL;
+    }
+    hashes = (size_t *) work;
+    pos = hashes + n;
+    w.start = pos + n;
+    w.members = w.start + ndisps + 1;
+    w.order = w.members + n;
+    w.chd = (map_chd_t *) (w.order + ndisps);
+    entries = (const void **) (w.chd + n);
+    w.taken = (unsigned char *) (entries + 2 * n + 1);
+    /* Key and value of each entry, and the room their strings take */
+    for (i = 0; (entries[2 * i] = map_next_(m, &it)) != NULL; i++) {
+        entries[2 * i + 1] = map_iter_value(m, &it);
+        if (m->flags & MAP_STRKEYS_) {
+            str.len = MAP_STRLEN(*(char * const *) entries[2 * i]);
+            strbytes += map_roundup(map_strkey_size(&str), sizeof(size_t));
+        }
+    }
+    map_slot_layout(m);
+    slotbytes = map_roundup(n * m->slotsize, sizeof(size_t));
+    mem = (char *) map_malloc(m, slotbytes + ndisps * sizeof(size_t) + strbytes);
+    if (mem == NULL) {
+        map_free(m, work);
+        return NULL;
+    }
+    /* Padding too, images are written straight from here */
+    memset(mem, 0, slotbytes);
+    disps = (size_t *) (mem + slotbytes);
+    strmem = (char *) (disps + ndisps);
+    for (tries = 0; tries < MAP_CHD_SEEDS && !built; tries++) {
+        seed = map_hash_mix(tries + 1);
+        for (i = 0; i < n; i++) {
+            hashes[i] = map_frozen_hash(m, entries[2 * i], m->ksize, seed);
+        }
+        built = map_chd_build(&w, hashes, n, ndisps, disps, pos);
+    }
+    if (!built) {
+        map_free(m, mem);
+        map_free(m, work);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        slot = mem + pos[i] * m->slotsize;
+        if (m->flags & MAP_STRKEYS_) {
+            str.str = *(char * const *) entries[2 * i];
+            str.len = MAP_STRLEN(str.str);
+            *(char **) slot = map_strkey_init(strmem, &str);
+            strmem += map_roundup(map_strkey_size(&str), sizeof(size_t));
+        } else {
+            memcpy(slot, entries[2 * i], m->ksize);
+        }
+        memcpy(slot + m->slotvoff, entries[2 * i + 1], m->vsize);
+    }
+    map_free(m, work);
+    *ndisps_out = ndisps;
+    *seed_out = seed;
+    return mem;
+}
+
+int map_freeze_(map_base_t *m) {
+    map_base_t old;
+    size_t n = m->nnodes, ndisps, seed;
+    char *mem;
+    if (m->flags & MAP_FROZEN_) {
+        return 1;
+    }
+    if ((mem = map_frozen_build(m, &ndisps, &seed)) == NULL) {
+        return 0;
+    }
+    /* Release the old storage, keeping the configuration */
+    old = *m;
+    map_delete_(&old);
+    *m = old;
+    m->buckets = (map_node_t **) mem;
+    m->nbuckets = n;
+    m->nnodes = n;
+    m->disps = (size_t *) (mem + map_roundup(n * m->slotsize, sizeof(size_t)));
+    m->ndisps = ndisps;
+    m->pseed = seed;
+    m->flags |= MAP_FROZEN_;
+    return 1;
+}
+
+
+int map_save_(map_base_t *m, const char *path) {
+    map_image_t hdr;
+    static const char pad[MAP_IMAGE_HDR];
+    size_t ndisps, seed;
+    char *mem, *tmp;
+    FILE *f;
+    int ok;
+    if (m->cmp_func != map_generic_cmp || (m->flags & MAP_STRKEYS_)) {
+        /* Keys other than plain bytes would need their pointers */
+        return 0;
+    }
+    if (m->flags & MAP_FROZEN_) {
+        mem = (char *) m->buckets;
+        ndisps = m->ndisps;
+        seed = m->pseed;
+    } else if ((mem = map_frozen_build(m, &ndisps, &seed)) == NULL) {
+        return 0;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MAP_IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = MAP_IMAGE_VERSION;
+    hdr.order = MAP_IMAGE_ORDER;
+    hdr.ksize = m->ksize;
+    hdr.vsize = m->vsize;
+    hdr.slotsize = m->slotsize;
+    hdr.slotvoff = m->slotvoff;
+    hdr.nnodes = m->nnodes;
+    hdr.ndisps = ndisps;
+    hdr.pseed = seed;
+    hdr.datasize = map_roundup(m->nnodes * m->slotsize, sizeof(size_t)) + ndisps * sizeof(size_t);
+    hdr.datasum = map_fast_hash_seeded(mem, hdr.datasize, 0);
+    hdr.hdrsum = map_image_hdrsum(&hdr);
+    /* Written next to the file and renamed over it, which leaves existing mappings of it intact */
+    f = NULL;
+    if ((tmp = (char *) map_malloc(m, strlen(path) + sizeof(".tmp"))) != NULL) {
+        strcpy(tmp, path);
+        strcat(tmp, ".tmp");
+        f = fopen(tmp, "wb");
+    }
+    ok = f != NULL &&
+         fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+         fwrite(pad, MAP_IMAGE_HDR - sizeof(hdr), 1, f) == 1 &&
+         fwrite(mem, 1, hdr.datasize, f) == hdr.datasize;
+    if (f != NULL && fclose(f) != 0) {
+        ok = 0;
+    }
+    if (ok && rename(tmp, path) != 0) {
+        /* Some systems don't rename over an existing file */
+        ok = remove(path) == 0 && rename(tmp, path) == 0;
+    }
+    if (f != NULL && !ok) {
+        remove(tmp);
+    }
+    map_free(m, tmp);
+    if (!(m->flags & MAP_FROZEN_)) {
+        map_free(m, mem);
+    }
+    return ok;
+}
+
+int map_open_mmap_(map_base_t *m, const char *path) {
+    map_base_t layout = *m;
+    const map_image_t *hdr;
+    size_t size;
+    char *data;
+    if (m->cmp_func != map_generic_cmp || (m->flags & MAP_STRKEYS_)) {
+        return 0;
+    }
+    if ((data = map_mapfile(m, path, &size)) == NULL) {
+        return 0;
+    }
+    hdr = (const map_image_t *) data;
+    map_slot_layout(&layout);
+    if (size < MAP_IMAGE_HDR || memcmp(hdr->magic, MAP_IMAGE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != MAP_IMAGE_VERSION || hdr->order != MAP_IMAGE_ORDER ||
+        hdr->hdrsum != map_image_hdrsum(hdr) ||
+        hdr->ksize != m->ksize || hdr->vsize != m->vsize ||
+        hdr->slotsize != layout.slotsize || hdr->slotvoff != layout.slotvoff ||
+        hdr->ndisps == 0 || hdr->nnodes > MAP_CHD_D1MASK || hdr->nnodes > size / hdr->slotsize ||
+        hdr->ndisps > size / sizeof(size_t) ||
+        hdr->datasize != map_roundup(hdr->nnodes * hdr->slotsize, sizeof(size_t)) + hdr->ndisps * sizeof(size_t) ||
+        size - MAP_IMAGE_HDR != hdr->datasize) {
+        map_unmapfile(m, data, size);
+        return 0;
+    }
+    map_delete_(m);
+    m->slotsize = hdr->slotsize;
+    m->slotvoff = hdr->slotvoff;
+    m->buckets = (map_node_t **) (data + MAP_IMAGE_HDR);
+    m->nbuckets = hdr->nnodes;
+    m->nnodes = hdr->nnodes;
+    m->disps = (size_t *) (data + MAP_IMAGE_HDR + hdr->datasize) - hdr->ndisps;
+    m->ndisps = hdr->ndisps;
+    m->pseed = hdr->pseed;
+    m->mapping = data;
+    m->mapsize = size;
+    m->flags |= MAP_FROZEN_ | MAP_MAPPED_;
+    return 1;
+}
+
+int map_verify_(map_base_t *m) {
+    const map_image_t *hdr = (const map_image_t *) m->mapping;
+    if (!(m->flags & MAP_MAPPED_)) {
+        return 0;
+    }
+    return map_fast_hash_seeded((const char *) m->mapping + MAP_IMAGE_HDR, hdr->datasize, 0) == hdr->datasum;
+}
+
+/* Engine dispatch for a prepared lookup */
+static void *map_lookup_get(map_base_t *m, const map_lookup_t *l, size_t ksize) {
+    map_node_t **next;
+    if (m->flags & MAP_FROZEN_) {
+        return map_frozen_get(m, l, ksize);
+    }
+    if (m->flags & MAP_FLAT_) {
+        return map_flat_get(m, l, ksize);
+    }
+    if (m->flags & MAP_DENSE_) {
+        return map_dense_get(m, l, ksize);
+    }
+    next = map_getref(m, l, ksize);
+    return next != NULL ? (*next)->value : NULL;
+}
+
+
+/* Links a new node for a key known to be missing from a chained map, growing it if needed */
+static void *map_chained_add(map_base_t *m, const map_lookup_t *l, const void *key, size_t ksize, size_t koffset, const void *value, size_t vsize, size_t voffset) {
+    size_t n;
+    map_node_t **next, *node;
+    node = map_newnode(m, l, key, ksize, koffset, value, vsize, voffset);
+    if (node == NULL) {
+        return NULL;
+    }
+    if (m->nnodes >= m->growat) {
+        n = (m->nbuckets > 0) ? (m->nbuckets * 2) : map_nbuckets_for(m, 1);
+        if (!((m->flags & MAP_INCREMENTAL_) ? MAP_RESIZE(m, map_resize_incremental, n) : MAP_RESIZE(m, map_resize, n))) {
+            map_freenode(m, node);
+            return NULL;
+        }
+    }
+    next = map_bucketref(m, node->hash);
+    node->next = *next;
+    *next = node;
+    m->nnodes++;
+    return node->value;
+}
+
+/* Finds the value of the key, adding the key with value if it's missing */
+static void *map_lookup_insert(map_base_t *m, const map_lookup_t *l, const void *key, size_t ksize, size_t koffset, const void *value, size_t vsize, size_t voffset, int *inserted) {
+    map_node_t **next;
+    if (m->flags & MAP_FROZEN_) {
+        *inserted = 0;
+        return map_frozen_get(m, l, ksize);
+    }
+    if (m->flags & MAP_FLAT_) {
+        return map_flat_insert(m, l, key, ksize, value, vsize, inserted);
+    }
+    if (m->flags & MAP_DENSE_) {
+        return map_dense_insert(m, l, key, ksize, value, vsize, inserted);
+    }
+    next = map_getref(m, l, ksize);
+    if (next != NULL) {
+        *inserted = 0;
+        return (*next)->value;
+    }
+    *inserted = 1;
+    return map_chained_add(m, l, key, ksize, koffset, value, vsize, voffset);
+}
+static int map_lookup_set(map_base_t *m, const map_lookup_t *l, const void *key, size_t ksize, size_t koffset, const void *value, size_t vsize, size_t voffset) {
+    int inserted;
+    void *ref;
+    if (m->flags & MAP_FROZEN_) {
+        return 0;
+    }
+    ref = map_lookup_insert(m, l, key, ksize, koffset, value, vsize, voffset, &inserted);
+    if (ref == NULL) {
+        return 0;
+    }
+    if (!inserted) {
+        /* Replace the value of the existing entry */
+        memcpy(ref, value, vsize);
+    }
+    return 1;
+}
+
+
+static void map_lookup_remove(map_base_t *m, const map_lookup_t *l, size_t ksize) {
+    map_node_t *node;
+    map_node_t **next;
+    if (m->flags & MAP_FROZEN_) {
+        return;
+    }
+    if (m->flags & MAP_FLAT_) {
+        map_flat_remove(m, l, ksize);
+    } else if (m->flags & MAP_DENSE_) {
+        map_dense_remove(m, l, ksize);
+    } else if ((next = map_getref(m, l, ksize)) != NULL) {
+        node = *next;
+        *next = (*next)->next;
+        map_freenode(m, node);
+        m->nnodes--;
+    }
+    if (m->nnodes < m->shrinkat) {
+        /* Leave room to grow back before the next resize, failing to shrink is harmless */
+        map_shrink(m, map_nbuckets_for(m, m->nnodes * 2));
+    }
+}
+
+
+void *map_get_(map_base_t *m, const void *key, size_t ksize) {
+    map_lookup_t l;
+    map_lookup_init(m, &l, key, ksize);
+    return map_lookup_get(m, &l, ksize);
+}
+
+
+int map_set_(map_base_t *m, const void *key, size_t ksize, size_t koffset, const void *value, size_t vsize, size_t voffset) {
+    map_lookup_t l;
+    map_lookup_init(m, &l, key, ksize);
+    return map_lookup_set(m, &l, key, ksize, koffset, value, vsize, voffset);
+}
+
+
+void map_remove_(map_base_t *m, const void *key, size_t ksize) {
+    map_lookup_t l;
+    map_lookup_init(m, &l, key, ksize);
+    map_lookup_remove(m, &l, ksize);
+}
+
+
+void *map_get_or_insert_(map_base_t *m, const void *key, size_t ksize, size_t koffset, const void *value, size_t vsize, size_t voffset, int *inserted) {
+    map_lookup_t l;
+    int dummy;
+    map_lookup_init(m, &l, key, ksize);
+    return map_lookup_insert(m, &l, key, ksize, koffset, value, vsize, voffset, (inserted != NULL) ? inserted : &dummy);
+}
+
+
+size_t map_keyhash_(map_base_t *m, const void *key, size_t ksize) {
+    return map_hash(m, key, ksize);
+}
+
+
+void *map_get_hashed_(map_base_t *m, const void *key, size_t ksize, size_t hash) {
+    map_lookup_t l;
+    map_lookup_init_hashed(m, &l, key, hash);
+    return map_lookup_get(m, &l, ksize);
+}
+
+
+int map_set_hashed_(map_base_t *m, const void *key, size_t ksize, size_t hash, size_t koffset, const void *value, size_t vsize, size_t voffset) {
+    map_lookup_t l;
+    map_lookup_init_hashed(m, &l, key, hash);
+    return map_lookup_set(m, &l, key, ksize, koffset, value, vsize, voffset);
+}
+
+
+void map_remove_hashed_(map_base_t *m, const void *key, size_t ksize, size_t hash) {
+    map_lookup_t l;
+    map_lookup_init_hashed(m, &l, key, hash);
+    map_lookup_remove(m, &l, ksize);
+}
+
+
+int map_add_hashed_(map_base_t *m, const void *key, size_t ksize, size_t hash, size_t koffset, const void *value, size_t vsize, size_t voffset) {
+    map_lookup_t l;
+    map_lookup_init_hashed(m, &l, key, hash);
+    return map_chained_add(m, &l, key, ksize, koffset, value, vsize, voffset) != NULL;
+}
+
+
+/*
+ * String slices. When the map hashes with one of the built-in string hashes and
+ * compares with map_string_cmp (or owns its keys), a (pointer, length) pair is hashed
+ * and compared in place. Otherwise it's copied into a nul-terminated buffer first.
+ */
+
+#define MAP_SLICE_BUF 256
+
+static int map_slice_cmp(const void *slice, const void *stored, size_t memsize) {
+    const map_slice_t *s = (const map_slice_t *) slice;
+    const char *str = *(const char * const *) stored;
+    size_t i;
+    (void) memsize;
+    for (i = 0; i < s->len; i++) {
+        if (str[i] != s->str[i] || str[i] == '\0') {
+            return 1;
+        }
+    }
+    return str[i] != '\0';
+}
+
+/* Sets up a lookup of the slice, 0 if the map's functions can't take one directly */
+static int map_lookup_slice(map_base_t *m, map_lookup_t *l, const char *str, size_t len) {
+    /* Doesn't go through map_lookup_init_hashed, which would sync the inline entries */
+    map_small_sync(m);
+    if ((m->flags & MAP_FROZEN_) && m->cmp_func == map_string_cmp) {
+        l->hash = map_fast_hash_seeded(str, len, m->pseed);
+    } else if (m->seed_hash_func == map_fast_string_hash_seeded) {
+        l->hash = map_fast_hash_seeded(str, len, m->seed);
+    } else if (m->seed_hash_func != NULL) {
+        return 0;
+    } else if (m->hash_func == map_fast_string_hash) {
+        l->hash = map_fast_hash(str, len);
+    } else if (m->hash_func == map_string_hash) {
+        l->hash = map_generic_hash(str, len);
+    } else {
+        return 0;
+    }
+    if (m->flags & MAP_STRKEYS_) {
+        l->cmp = map_strkey_cmp;
+    } else if (m->cmp_func == map_string_cmp) {
+        l->cmp = map_slice_cmp;
+    } else {
+        return 0;
+    }
+    l->str.str = str;
+    l->str.len = len;
+    l->key = &l->str;
+    return 1;
+}
+
+/* Nul-terminated copy of the slice, in buf if it fits */
+static char *map_slice_dup(map_base_t *m, const char *str, size_t len, char *buf) {
+    char *copy = (len < MAP_SLICE_BUF) ? buf : (char *) map_malloc(m, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+void *map_get_slice_(map_base_t *m, const char *str, size_t len) {
+    map_lookup_t l;
+    char buf[MAP_SLICE_BUF], *copy;
+    void *value;
+    if (map_lookup_slice(m, &l, str, len)) {
+        return map_lookup_get(m, &l, sizeof(copy));
+    }
+    if ((copy = map_slice_dup(m, str, len, buf)) == NULL) {
+        return NULL;
+    }
+    value = map_get_(m, &copy, sizeof(copy));
+    if (copy != buf) {
+        map_free(m, copy);
+    }
+    return value;
+}
+
+int map_set_slice_(map_base_t *m, const char *str, size_t len, size_t koffset, const void *value, size_t vsize, size_t voffset) {
+    map_lookup_t l;
+    char buf[MAP_SLICE_BUF], *copy;
+    int res;
+    if (!(m->flags & MAP_STRKEYS_)) {
+        /* Nothing would own the bytes of the key */
+        return 0;
+    }
+    if (map_lookup_slice(m, &l, str, len)) {
+        return map_lookup_set(m, &l, NULL, sizeof(copy), koffset, value, vsize, voffset);
+    }
+    if ((copy = map_slice_dup(m, str, len, buf)) == NULL) {
+        return 0;
+    }
+    res = map_set_(m, &copy, sizeof(copy), koffset, value, vsize, voffset);
+    if (copy != buf) {
+        map_free(m, copy);
+    }
+    return res;
+}
+
+void map_remove_slice_(map_base_t *m, const char *str, size_t len) {
+    map_lookup_t l;
+    char buf[MAP_SLICE_BUF], *copy;
+    if (map_lookup_slice(m, &l, str, len)) {
+        map_lookup_remove(m, &l, sizeof(copy));
+    } else if ((copy = map_slice_dup(m, str, len, buf)) != NULL) {
+        map_remove_(m, &copy, sizeof(copy));
+        if (copy != buf) {
+            map_free(m, copy);
+        }
+    }
+}
+
+
+/*
+ * Batches. Keys are handled MAP_BATCH at a time in three passes: hash and prefetch
+ * the bucket (or control group), prefetch the first node (or candidate slot),
+ * then do the actual lookups, so the cache misses of a batch overlap.
+ */
+
+#define MAP_BATCH 16
+
+static void map_prefetch_bucket(map_base_t *m, const map_lookup_t *l) {
+    size_t g;
+    map_chd_t c;
+    if (m->nbuckets == 0) {
+        return;
+    }
+    if (m->flags & MAP_FROZEN_) {
+        map_chd_hash(l->hash, m->nbuckets, m->ndisps, &c);
+        MAP_PREFETCH(m->disps + c.bucket);
+    } else if (m->flags & MAP_FLAT_) {
+        g = (MAP_H1(l->hash) & (m->nbuckets / MAP_GROUP - 1)) * MAP_GROUP;
+        MAP_PREFETCH(m->ctrl + g);
+        MAP_PREFETCH(m->hashes + g);
+    } else if (m->flags & MAP_DENSE_) {
+        MAP_PREFETCH(MAP_DENSE_INDEX(m) + (l->hash & (m->nbuckets - 1)));
+    } else {
+        MAP_PREFETCH(map_bucketref(m, l->hash));
+    }
+}
+
+static void map_prefetch_entry(map_base_t *m, const map_lookup_t *l) {
+    size_t g, v;
+    unsigned match;
+    map_node_t *node;
+    if (m->nbuckets == 0) {
+        return;
+    }
+    if (m->flags & MAP_FROZEN_) {
+        MAP_PREFETCH(MAP_FLAT_SLOT(m, map_frozen_slot(m, l->hash)));
+    } else if (m->flags & MAP_FLAT_) {
+        g = (MAP_H1(l->hash) & (m->nbuckets / MAP_GROUP - 1)) * MAP_GROUP;
+        match = map_group_match(m->ctrl + g, MAP_H2(l->hash));
+        if (match) {
+            MAP_PREFETCH(MAP_FLAT_SLOT(m, g + map_ctz(match)));
+        }
+    } else if (m->flags & MAP_DENSE_) {
+        if ((v = MAP_DENSE_INDEX(m)[l->hash & (m->nbuckets - 1)]) != 0 && v != MAP_DENSE_DEAD) {
+            MAP_PREFETCH(MAP_DENSE_ENTRY(m, v - 1));
+        }
+    } else if ((node = *map_bucketref(m, l->hash)) != NULL) {
+        MAP_PREFETCH(node);
+        MAP_PREFETCH(node->key);
+    }
+}
+
+size_t map_get_many_(map_base_t *m, size_t count, const void *keys, size_t ksize, void **out) {
+    map_lookup_t l[MAP_BATCH];
+    size_t i, n, found = 0;
+    const char *key = (const char *) keys;
+    while (count > 0) {
+        n = (count < MAP_BATCH) ? count : MAP_BATCH;
+        for (i = 0; i < n; i++) {
+            map_lookup_init(m, &l[i], key + i * ksize, ksize);
+            map_prefetch_bucket(m, &l[i]);
+        }
+        for (i = 0; i < n; i++) {
+            map_prefetch_entry(m, &l[i]);
+        }
+        for (i = 0; i < n; i++) {
+            out[i] = map_lookup_get(m, &l[i], ksize);
+            found += (out[i] != NULL);
+        }
+        key += n * ksize;
+        out += n;
+        count -= n;
+    }
+    return found;
+}
+
+int map_set_many_(map_base_t *m, size_t count, const void *keys, size_t ksize, size_t koffset,
+                  const void *values, size_t vsize, size_t voffset) {
+    map_lookup_t l[MAP_BATCH];
+    size_t i, n;
+    const char *key = (const char *) keys, *value = (const char *) values;
+    /* Presize for the case of all keys being new, so prefetched buckets stay put */
+    if (!map_reserve_(m, m->nnodes + count)) {
+        return 0;
+    }
+    while (count > 0) {
+        n = (count < MAP_BATCH) ? count : MAP_BATCH;
+        for (i = 0; i < n; i++) {
+            map_lookup_init(m, &l[i], key + i * ksize, ksize);
+            map_prefetch_bucket(m, &l[i]);
+        }
+        for (i = 0; i < n; i++) {
+            map_prefetch_entry(m, &l[i]);
+        }
+        for (i = 0; i < n; i++) {
+            if (!map_lookup_set(m, &l[i], key + i * ksize, ksize, koffset, value + i * vsize, vsize, voffset)) {
+                return 0;
+            }
+        }
+        key += n * ksize;
+        value += n * vsize;
+        count -= n;
+    }
+    return 1;
+}
+
+void map_remove_many_(map_base_t *m, size_t count, const void *keys, size_t ksize) {
+    map_lookup_t l[MAP_BATCH];
+    size_t i, n;
+    const char *key = (const char *) keys;
+    while (count > 0) {
+        n = (count < MAP_BATCH) ? count : MAP_BATCH;
+        for (i = 0; i < n; i++) {
+            map_lookup_init(m, &l[i], key + i * ksize, ksize);
+            map_prefetch_bucket(m, &l[i]);
+        }
+        for (i = 0; i < n; i++) {
+            map_prefetch_entry(m, &l[i]);
+        }
+        for (i = 0; i < n; i++) {
+            map_lookup_remove(m, &l[i], ksize);
+        }
+        key += n * ksize;
+        count -= n;
+    }
+}
+
+
+map_iter_t map_iter_(void) {
+    map_iter_t iter;
+    iter.bucketidx = (size_t)-1;
+    iter.node = NULL;
+    iter.removed = 0;
+    iter.end = (size_t) -1;
+    return iter;
+}
+
+
+map_iter_t map_iter_range_(size_t begin, size_t end) {
+    map_iter_t iter = map_iter_();
+    /* Wraps to -1 for 0 just like map_iter_ */
+    iter.bucketidx = begin - 1;
+    iter.end = end;
+    return iter;
+}
+
+
+size_t map_iter_span_(map_base_t *m) {
+    if (m->flags & MAP_DENSE_) {
+        map_small_sync(m);
+        return m->nentries;
+    }
+    if (!(m->flags & (MAP_FLAT_ | MAP_FROZEN_))) {
+        /* Ranges of the new bucket array only, and map_next_ has nothing left to finish */
+        map_rehash_finish(m);
+    }
+    return m->nbuckets;
+}
+
+
+void *map_next_(map_base_t *m, map_iter_t *iter) {
+    if (m->flags & MAP_FROZEN_) {
+        return map_frozen_next(m, iter);
+    }
+    if (m->flags & MAP_FLAT_) {
+        return map_flat_next(m, iter);
+    }
+    if (m->flags & MAP_DENSE_) {
+        map_small_sync(m);
+        return map_dense_next(m, iter);
+    }
+    if (iter->bucketidx == (size_t) -1 && m->oldbuckets != NULL) {
+        /* Nodes must stay put while iterating, so complete a pending resize first */
+        map_rehash_finish(m);
+    }
+    iter->removed = 0;
+    if (iter->node != NULL) {
+        iter->node = iter->node->next;
+        if (iter->node == NULL) {
+            goto nextBucket;
+        }
+    } else {
+        nextBucket:
+        do {
+            if (++iter->bucketidx >= map_iter_stop(iter, m->nbuckets)) {
+                return NULL;
+            }
+            iter->node = m->buckets[iter->bucketidx];
+        } while (iter->node == NULL);
+    }
+    return iter->node->key;
+}
+
+
+int map_iter_remove_(map_base_t *m, map_iter_t *iter) {
+    map_node_t *node, *prev = NULL;
+    if (iter->bucketidx == (size_t) -1 || (m->flags & MAP_FROZEN_)) {
+        return 0;
+    }
+    if (m->flags & MAP_DENSE_) {
+        map_small_sync(m);
+        if (iter->bucketidx >= m->nentries || MAP_DENSE_SLOT(MAP_DENSE_ENTRY(m, iter->bucketidx)) == MAP_DENSE_DEAD) {
+            return 0;
+        }
+        map_dense_erase(m, iter->bucketidx);
+        return 1;
+    }
+    if (m->flags & MAP_FLAT_) {
+        if (iter->bucketidx >= m->nbuckets || (m->ctrl[iter->bucketidx] & MAP_CTRL_EMPTY)) {
+            return 0;
+        }
+        map_flat_erase(m, iter->bucketidx);
+        return 1;
+    }
+    if (iter->node == NULL || iter->removed) {
+        return 0;
+    }
+    for (node = m->buckets[iter->bucketidx]; node != iter->node; node = node->next) {
+        prev = node;
+    }
+    if (prev != NULL) {
+        prev->next = node->next;
+    } else {
+        m->buckets[iter->bucketidx] = node->next;
+        /* Step back so map_next_ starts the bucket over */
+        iter->bucketidx--;
+    }
+    iter->node = prev;
+    iter->removed = 1;
+    map_freenode(m, node);
+    m->nnodes--;
+    return 1;
+}
+
+
+int map_equal_(map_base_t *m1, map_base_t *m2, size_t ksize, size_t vsize, MapCmpFunction val_cmp_func) {
+    void *m1_key;
+    map_iter_t m1_it = map_iter(m1);
+    map_lookup_t l;
+    int samehash = map_samehash(m1, m2);
+    if (m1->nnodes != m2->nnodes){
+        return 0;
+    }
+    if (!val_cmp_func) val_cmp_func = map_generic_cmp;
+    while ((m1_key = map_next_(m1, &m1_it)) != 0){
+        /* m1's value is at hand and its stored hash is good for m2 unless they hash differently */
+        void *m2_val_ptr;
+        map_lookup_init_hashed(m2, &l, m1_key, samehash ? map_iter_hash(m1, &m1_it) : map_hash(m2, m1_key, ksize));
+        m2_val_ptr = map_lookup_get(m2, &l, ksize);
+        if (m2_val_ptr == NULL || val_cmp_func(map_iter_value(m1, &m1_it), m2_val_ptr, vsize) != 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int map_from_pairs_(map_base_t *m, size_t pcount, size_t psize,
+                    const void *key, size_t ksize, size_t koffset,
+                    const void *val, size_t vsize, size_t voffset) {
+    size_t i;
     for (i = 0; i < pcount; i++) {
         if (!map_set_(m, key, ksize, koffset, val, vsize, voffset)){
             return 0;
@@ -248,21 +2303,594 @@ int map_from_pairs_(map_base_t *m, size_t pcount, size_t psize,
     }
     return 1;
 }
-int map_copy_(map_base_t *m1, map_base_t *m2, size_t ksize, size_t koffset, size_t vsize, size_t voffset) {
-    map_node_t *next, *node;
-    size_t i;
-    if (m2->nbuckets > (m1->nbuckets - m1->nnodes) && !map_resize(m1, m2->nbuckets)) return 0;
+/* Gives a slot or entry its own copy of the owned string key it was copied with */
+static int map_strkey_dup(map_base_t *m, void *stored) {
+    size_t size = sizeof(size_t) + MAP_STRLEN(*(char **) stored) + 1;
+    char *block = (char *) map_malloc(m, size);
+    if (block == NULL) {
+        return 0;
+    }
+    memcpy(block, map_strkey_block(stored), size);
+    *(char **) stored = block + sizeof(size_t);
+    return 1;
+}
 
-    i = m2->nbuckets;
-    while (i--) {
-        node = m2->buckets[i];
-        while (node != NULL) {
-            next = node->next;
-            if (!map_set_(m1, node->key, ksize, koffset, node->value, vsize, voffset)){
+/*
+ * Structural copy of m2 into m1, which hashes, compares and stores keys the same way:
+ * the slot and entry arrays are copied in one go and chained nodes are duplicated into
+ * the same bucket and order, all keeping their stored hashes.
+ */
+static int map_clone(map_base_t *m1, map_base_t *m2, size_t ksize, size_t koffset, size_t vsize, size_t voffset) {
+    size_t i, j, bytes;
+    map_node_t *node, **tail;
+    map_lookup_t l;
+    char *mem;
+    map_delete_(m1);
+    map_rehash_finish(m2);
+    if (m2->nbuckets == 0) {
+        return 1;
+    }
+    if (m2->flags & MAP_FLAT_) {
+        bytes = m2->nbuckets * (m2->slotsize + sizeof(*m2->hashes) + 1);
+        if ((mem = (char *) map_malloc(m1, bytes)) == NULL) {
+            return 0;
+        }
+        memcpy(mem, m2->buckets, bytes);
+        m1->slotsize = m2->slotsize;
+        m1->slotvoff = m2->slotvoff;
+        m1->buckets = (map_node_t **) mem;
+        m1->hashes = (size_t *) (mem + m2->nbuckets * m2->slotsize);
+        m1->ctrl = (unsigned char *) (m1->hashes + m2->nbuckets);
+        m1->nbuckets = m2->nbuckets;
+        m1->ntombs = m2->ntombs;
+        for (i = 0; (m1->flags & MAP_STRKEYS_) && i < m1->nbuckets; i++) {
+            if (!(m1->ctrl[i] & MAP_CTRL_EMPTY) && !map_strkey_dup(m1, MAP_FLAT_SLOT(m1, i))) {
+                /* The rest still share m2's strings */
+                for (j = i; j < m1->nbuckets; j++) {
+                    m1->ctrl[j] = MAP_CTRL_EMPTY;
+                }
+                map_delete_(m1);
                 return 0;
             }
-            node = next;
+        }
+    } else if (m2->flags & MAP_DENSE_) {
+        bytes = m2->nbuckets * sizeof(size_t);
+        if ((mem = (char *) map_malloc(m1, bytes)) == NULL) {
+            return 0;
+        }
+        if ((m1->entries = (char *) map_malloc(m1, m2->entcap * m2->entsize)) == NULL) {
+            map_free(m1, mem);
+            return 0;
+        }
+        memcpy(mem, m2->buckets, bytes);
+        memcpy(m1->entries, m2->entries, m2->nentries * m2->entsize);
+        m1->buckets = (map_node_t **) mem;
+        m1->nbuckets = m2->nbuckets;
+        m1->entsize = m2->entsize;
+        m1->entkoff = m2->entkoff;
+        m1->entvoff = m2->entvoff;
+        m1->nentries = m2->nentries;
+        m1->entcap = m2->entcap;
+        for (i = 0; (m1->flags & MAP_STRKEYS_) && i < m1->nentries; i++) {
+            mem = MAP_DENSE_ENTRY(m1, i);
+            if (MAP_DENSE_SLOT(mem) != MAP_DENSE_DEAD && !map_strkey_dup(m1, mem + m1->entkoff)) {
+                for (j = i; j < m1->nentries; j++) {
+                    MAP_DENSE_SLOT(MAP_DENSE_ENTRY(m1, j)) = MAP_DENSE_DEAD;
+                }
+                map_delete_(m1);
+                return 0;
+            }
+        }
+    } else {
+        bytes = m2->nbuckets * sizeof(*m2->buckets);
+        if ((m1->buckets = (map_node_t **) map_malloc(m1, bytes)) == NULL) {
+            return 0;
+        }
+        memset(m1->buckets, 0, bytes);
+        m1->nbuckets = m2->nbuckets;
+        for (i = 0; i < m2->nbuckets; i++) {
+            tail = &m1->buckets[i];
+            for (node = m2->buckets[i]; node != NULL; node = node->next) {
+                map_lookup_init_hashed(m1, &l, node->key, node->hash);
+                if ((*tail = map_newnode(m1, &l, node->key, ksize, koffset, node->value, vsize, voffset)) == NULL) {
+                    map_delete_(m1);
+                    return 0;
+                }
+                tail = &(*tail)->next;
+            }
+        }
+    }
+    m1->nnodes = m2->nnodes;
+    map_setlimits(m1);
+    return 1;
+}
+
+int map_copy_(map_base_t *m1, map_base_t *m2, size_t ksize, size_t koffset, size_t vsize, size_t voffset) {
+    void *key;
+    map_iter_t it = map_iter_();
+    unsigned layout = MAP_FLAT_ | MAP_DENSE_ | MAP_STRKEYS_ | MAP_CACHE_;
+    if (m1->flags & MAP_FROZEN_) {
+        return 0;
+    }
+    if (m1->nnodes == 0 && map_samehash(m1, m2) && m1->cmp_func == m2->cmp_func
+        && (m1->flags & layout) == (m2->flags & layout) && m2->nnodes <= map_capacity(m1, m2->nbuckets)
+        && (!(m1->flags & MAP_CACHE_) || m2->nnodes <= m1->maxentries) && !((m1->flags | m2->flags) & MAP_SMALL_)) {
+        return map_clone(m1, m2, ksize, koffset, vsize, voffset);
+    }
+    /* Sized for the entries, m2's bucket count may not be a power of two or fit m1 at all */
+    if (!map_reserve_(m1, m1->nnodes + m2->nnodes)) {
+        return 0;
+    }
+    while ((key = map_next_(m2, &it)) != NULL) {
+        if (!map_set_(m1, key, ksize, koffset, map_iter_value(m2, &it), vsize, voffset)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Set operations, see map_merge.
+ * Keys of one map are looked up in the other with the hash stored for them whenever
+ * both maps hash the same way.
+ */
+
+/* Sets l up to find the key at it, taken from map from, in map to */
+static void map_lookup_init_from(map_base_t *to, map_lookup_t *l, map_base_t *from, map_iter_t *it, const void *key, size_t ksize) {
+    map_lookup_init_hashed(to, l, key, map_samehash(from, to) ? map_iter_hash(from, it) : map_hash(to, key, ksize));
+}
+
+/* Shrinks or compacts m after removals that left it alone */
+static void map_trim(map_base_t *m) {
+    if (m->nnodes < m->shrinkat) {
+        map_shrink(m, map_nbuckets_for(m, m->nnodes * 2));
+    } else if ((m->flags & MAP_DENSE_) && m->nbuckets > 0 && m->nentries - m->nnodes > m->nnodes) {
+        MAP_RESIZE(m, map_dense_resize, m->nbuckets);
+    }
+}
+
+/* Whether m2's nodes can be relinked into m1 as they are */
+static int map_canmove(map_base_t *m1, map_base_t *m2) {
+    return !((m1->flags | m2->flags) & (MAP_FLAT_ | MAP_DENSE_ | MAP_FROZEN_)) && !MAP_POOLED(m1) && !MAP_POOLED(m2)
+        && m1->allocator == m2->allocator && (m1->flags & MAP_STRKEYS_) == (m2->flags & MAP_STRKEYS_)
+        && m1->cmp_func == m2->cmp_func && map_samehash(m1, m2);
+}
+
+int map_merge_(map_base_t *m1, map_base_t *m2, size_t ksize, size_t koffset, size_t vsize, size_t voffset,
+               MapCombineFunction combine_func, int move) {
+    map_iter_t it = map_iter_();
+    map_lookup_t l;
+    map_node_t *node, *next;
+    void *key, *value;
+    size_t i;
+    int inserted;
+    if ((m1->flags & MAP_FROZEN_) || m1 == m2 || !map_reserve_(m1, m1->nnodes + m2->nnodes)) {
+        return 0;
+    }
+    if (move && map_canmove(m1, m2)) {
+        map_rehash_finish(m1);
+        map_rehash_finish(m2);
+        for (i = 0; i < m2->nbuckets; i++) {
+            for (node = m2->buckets[i]; node != NULL; node = next) {
+                next = node->next;
+                map_lookup_init_hashed(m1, &l, node->key, node->hash);
+                if ((value = map_lookup_get(m1, &l, ksize)) == NULL) {
+                    map_addnode(m1, node);
+                    m1->nnodes++;
+                } else {
+                    if (combine_func != NULL) {
+                        combine_func(value, node->value, vsize);
+                    } else {
+                        memcpy(value, node->value, vsize);
+                    }
+                    map_freenode(m2, node);
+                }
+            }
+            m2->buckets[i] = NULL;
+        }
+        m2->nnodes = 0;
+        map_delete_(m2);
+        return 1;
+    }
+    while ((key = map_next_(m2, &it)) != NULL) {
+        map_lookup_init_from(m1, &l, m2, &it, key, ksize);
+        if ((value = map_lookup_insert(m1, &l, key, ksize, koffset, map_iter_value(m2, &it), vsize, voffset, &inserted)) == NULL) {
+            return 0;
+        }
+        if (!inserted) {
+            if (combine_func != NULL) {
+                combine_func(value, map_iter_value(m2, &it), vsize);
+            } else {
+                memcpy(value, map_iter_value(m2, &it), vsize);
+            }
+        }
+    }
+    if (move) {
+        map_delete_(m2);
+    }
+    return 1;
+}
+
+int map_intersect_(map_base_t *m1, map_base_t *m2, size_t ksize) {
+    map_iter_t it = map_iter_();
+    map_lookup_t l;
+    void *key;
+    if (m1->flags & MAP_FROZEN_) {
+        return 0;
+    }
+    if (m1 == m2) {
+        return 1;
+    }
+    while ((key = map_next_(m1, &it)) != NULL) {
+        map_lookup_init_from(m2, &l, m1, &it, key, ksize);
+        if (map_lookup_get(m2, &l, ksize) == NULL) {
+            map_iter_remove_(m1, &it);
+        }
+    }
+    map_trim(m1);
+    return 1;
+}
+
+int map_difference_(map_base_t *m1, map_base_t *m2, size_t ksize) {
+    map_iter_t it = map_iter_();
+    map_lookup_t l;
+    void *key;
+    if (m1->flags & MAP_FROZEN_) {
+        return 0;
+    }
+    if (m1 == m2) {
+        map_delete_(m1);
+        return 1;
+    }
+    if (m2->nnodes < m1->nnodes) {
+        /* Fewer lookups the other way around */
+        while ((key = map_next_(m2, &it)) != NULL) {
+            map_lookup_init_from(m1, &l, m2, &it, key, ksize);
+            map_lookup_remove(m1, &l, ksize);
+        }
+        return 1;
+    }
+    while ((key = map_next_(m1, &it)) != NULL) {
+        map_lookup_init_from(m2, &l, m1, &it, key, ksize);
+        if (map_lookup_get(m2, &l, ksize) != NULL) {
+            map_iter_remove_(m1, &it);
         }
     }
+    map_trim(m1);
     return 1;
 }
+
+#define MAP_BULK_MAXTHREADS 64
+/* Fewer pairs per thread aren't worth starting it */
+#define MAP_BULK_MINPAIRS 4096
+
+/*
+ * Runs work on n workers wsize bytes apart, one thread each and the calling thread doing
+ * the first one's share. Shares of threads that can't be started are done by the caller.
+ */
+static void map_run_workers(void *(*work)(void *), void *workers, size_t wsize, size_t n) {
+    char *w = (char *) workers;
+    size_t i;
+#ifdef MAP_THREADS
+    pthread_t threads[MAP_BULK_MAXTHREADS];
+    size_t started;
+    for (started = 1; started < n; started++) {
+        if (pthread_create(&threads[started], NULL, work, w + started * wsize) != 0) {
+            break;
+        }
+    }
+    work(w);
+    for (i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = started; i < n; i++) {
+        work(w + i * wsize);
+    }
+#else
+    for (i = 0; i < n; i++) {
+        work(w + i * wsize);
+    }
+#endif
+}
+
+static size_t map_bulk_threads(size_t nthreads, size_t count) {
+#ifdef MAP_THREADS
+    long ncpu;
+    if (nthreads == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = (ncpu > 0) ? (size_t) ncpu : 1;
+    }
+#else
+    nthreads = 1;
+#endif
+    if (nthreads > count / MAP_BULK_MINPAIRS) {
+        nthreads = count / MAP_BULK_MINPAIRS;
+    }
+    if (nthreads > MAP_BULK_MAXTHREADS) {
+        nthreads = MAP_BULK_MAXTHREADS;
+    }
+    return (nthreads > 0) ? nthreads : 1;
+}
+
+
+/*
+ * Parallel bulk build, see map_from_pairs_parallel.
+ * The map is sized once for all pairs, then workers hash their share of the pairs and count
+ * how many land in each worker's range of buckets. A prefix sum turns the counts into
+ * offsets, the workers scatter pair indices into one array grouped by range, and each
+ * worker links the pairs of its own range, so no bucket is touched by two threads.
+ * Indices keep the input order inside a range, so the last of duplicate keys wins as with
+ * map_set. Open addressing probes cross any range and pools and custom allocators aren't
+ * thread-safe, so those maps get the parallel hashing only and are filled by the caller.
+ */
+
+typedef struct {
+    map_base_t *m;
+    /* pairs stride bytes apart, or key/value pointer pairs in refs */
+    const char *keys, *vals;
+    size_t stride;
+    void **refs;
+    size_t count, ksize, koffset, vsize, voffset;
+    size_t nthreads, perrange;
+    /* hashes by pair, pair indices grouped by range, counts[thread * nthreads + range],
+     * where each range's indices start in order */
+    size_t *hashes, *order, *counts, *starts;
+} map_bulk_t;
+
+typedef struct {
+    map_bulk_t *b;
+    size_t id, added;
+    int phase, ok;
+} map_bulk_worker_t;
+
+enum { MAP_BULK_HASH, MAP_BULK_SCATTER, MAP_BULK_LINK };
+
+static const void *map_bulk_key(const map_bulk_t *b, size_t i) {
+    return (b->refs != NULL) ? b->refs[2 * i] : b->keys + i * b->stride;
+}
+
+static const void *map_bulk_value(const map_bulk_t *b, size_t i) {
+    return (b->refs != NULL) ? b->refs[2 * i + 1] : b->vals + i * b->stride;
+}
+
+static size_t map_bulk_range(const map_bulk_t *b, size_t hash) {
+    return map_bucketidx(b->m, hash) / b->perrange;
+}
+
+static void *map_bulk_work(void *arg) {
+    map_bulk_worker_t *w = (map_bulk_worker_t *) arg;
+    map_bulk_t *b = w->b;
+    map_base_t *m = b->m;
+    size_t i, j, end, first = b->count * w->id / b->nthreads, last = b->count * (w->id + 1) / b->nthreads;
+    size_t *counts = b->counts + w->id * b->nthreads;
+    map_lookup_t l;
+    map_node_t *node;
+    const void *key;
+    switch (w->phase) {
+        case MAP_BULK_HASH:
+            for (i = first; i < last; i++) {
+                b->hashes[i] = map_hash(m, map_bulk_key(b, i), b->ksize);
+                if (b->counts != NULL) {
+                    counts[map_bulk_range(b, b->hashes[i])]++;
+                }
+            }
+            break;
+        case MAP_BULK_SCATTER:
+            /* counts now holds where this thread's pairs of each range go */
+            for (i = first; i < last; i++) {
+                b->order[counts[map_bulk_range(b, b->hashes[i])]++] = i;
+            }
+            break;
+        default:
+            for (j = b->starts[w->id], end = b->starts[w->id + 1]; j < end; j++) {
+                i = b->order[j];
+                key = map_bulk_key(b, i);
+                map_lookup_init_hashed(m, &l, key, b->hashes[i]);
+                for (node = m->buckets[map_bucketidx(m, l.hash)]; node != NULL; node = node->next) {
+                    if (node->hash == l.hash && l.cmp(l.key, node->key, b->ksize) == 0) {
+                        break;
+                    }
+                }
+                if (node != NULL) {
+                    memcpy(node->value, map_bulk_value(b, i), b->vsize);
+                } else if ((node = map_newnode(m, &l, key, b->ksize, b->koffset, map_bulk_value(b, i), b->vsize, b->voffset)) != NULL) {
+                    map_addnode(m, node);
+                    w->added++;
+                } else {
+                    w->ok = 0;
+                    break;
+                }
+            }
+    }
+    return NULL;
+}
+
+/* Runs one phase on every worker */
+static int map_bulk_phase(map_bulk_worker_t *workers, size_t nthreads, int phase) {
+    size_t i;
+    int ok = 1;
+    for (i = 0; i < nthreads; i++) {
+        workers[i].phase = phase;
+    }
+    map_run_workers(map_bulk_work, workers, sizeof(*workers), nthreads);
+    for (i = 0; i < nthreads; i++) {
+        ok &= workers[i].ok;
+    }
+    return ok;
+}
+
+static int map_bulk_build(map_bulk_t *b, size_t nthreads) {
+    map_bulk_worker_t workers[MAP_BULK_MAXTHREADS];
+    map_base_t *m = b->m;
+    map_lookup_t l;
+    size_t i, r, sum, n;
+    /* Pools and custom allocators are only ever entered by one thread */
+    int link = !(m->flags & (MAP_FLAT_ | MAP_DENSE_)) && !MAP_POOLED(m) && m->allocator == NULL;
+    int ok = 0;
+    if (m->flags & MAP_FROZEN_) {
+        return 0;
+    }
+    if (b->count == 0) {
+        return 1;
+    }
+    map_rehash_finish(m);
+    if (!map_reserve_(m, m->nnodes + b->count)) {
+        return 0;
+    }
+    b->nthreads = nthreads = map_bulk_threads(nthreads, b->count);
+    /* One thread gains nothing from partitioning */
+    link = link && nthreads > 1;
+    b->perrange = (m->nbuckets + nthreads - 1) / nthreads;
+    b->hashes = (size_t *) map_malloc(m, b->count * sizeof(size_t));
+    b->order = link ? (size_t *) map_malloc(m, b->count * sizeof(size_t)) : NULL;
+    b->counts = link ? (size_t *) map_malloc(m, (nthreads * nthreads + nthreads + 1) * sizeof(size_t)) : NULL;
+    if (b->hashes == NULL || (link && (b->order == NULL || b->counts == NULL))) {
+        goto done;
+    }
+    if (link) {
+        memset(b->counts, 0, nthreads * nthreads * sizeof(size_t));
+    }
+    for (i = 0; i < nthreads; i++) {
+        workers[i].b = b;
+        workers[i].id = i;
+        workers[i].added = 0;
+        workers[i].ok = 1;
+    }
+    map_bulk_phase(workers, nthreads, MAP_BULK_HASH);
+    if (!link) {
+        /* Hashes are known, only the probing is left */
+        for (i = 0; i < b->count; i++) {
+            map_lookup_init_hashed(m, &l, map_bulk_key(b, i), b->hashes[i]);
+            if (!map_lookup_set(m, &l, map_bulk_key(b, i), b->ksize, b->koffset, map_bulk_value(b, i), b->vsize, b->voffset)) {
+                goto done;
+            }
+        }
+        ok = 1;
+        goto done;
+    }
+    /* Counts become offsets: ranges in order, the threads' pairs in order inside each */
+    b->starts = b->counts + nthreads * nthreads;
+    for (sum = r = 0; r < nthreads; r++) {
+        b->starts[r] = sum;
+        for (i = 0; i < nthreads; i++) {
+            n = b->counts[i * nthreads + r];
+            b->counts[i * nthreads + r] = sum;
+            sum += n;
+        }
+    }
+    b->starts[nthreads] = sum;
+    map_bulk_phase(workers, nthreads, MAP_BULK_SCATTER);
+    ok = map_bulk_phase(workers, nthreads, MAP_BULK_LINK);
+    for (i = 0; i < nthreads; i++) {
+        m->nnodes += workers[i].added;
+    }
+done:
+    map_free(m, b->counts);
+    map_free(m, b->order);
+    map_free(m, b->hashes);
+    return ok;
+}
+
+int map_from_pairs_parallel_(map_base_t *m, size_t pcount, size_t psize,
+                             const void *key, size_t ksize, size_t koffset,
+                             const void *val, size_t vsize, size_t voffset, size_t nthreads) {
+    map_bulk_t b;
+    b.m = m;
+    b.keys = (const char *) key;
+    b.vals = (const char *) val;
+    b.stride = psize;
+    b.refs = NULL;
+    b.count = pcount;
+    b.ksize = ksize;
+    b.koffset = koffset;
+    b.vsize = vsize;
+    b.voffset = voffset;
+    return map_bulk_build(&b, nthreads);
+}
+
+int map_copy_parallel_(map_base_t *m1, map_base_t *m2, size_t ksize, size_t koffset, size_t vsize, size_t voffset, size_t nthreads) {
+    map_iter_t it = map_iter_();
+    map_bulk_t b;
+    void *key;
+    size_t i = 0;
+    int ok;
+    if (m1 == m2 || m2->nnodes == 0) {
+        /* Nothing to add. A map copied into itself would also move the keys under the workers */
+        return !(m1->flags & MAP_FROZEN_);
+    }
+    b.m = m1;
+    b.keys = b.vals = NULL;
+    b.stride = 0;
+    b.count = m2->nnodes;
+    b.ksize = ksize;
+    b.koffset = koffset;
+    b.vsize = vsize;
+    b.voffset = voffset;
+    if ((b.refs = (void **) map_malloc(m1, 2 * b.count * sizeof(void *))) == NULL) {
+        return 0;
+    }
+    while ((key = map_next_(m2, &it)) != NULL) {
+        b.refs[i++] = key;
+        b.refs[i++] = map_iter_value(m2, &it);
+    }
+    ok = map_bulk_build(&b, nthreads);
+    map_free(m1, b.refs);
+    return ok;
+}
+
+
+/*
+ * Parallel scans, see map_parallel_reduce.
+ * The positions of map_iter_span are cut into one equal range per thread, each walked with
+ * its own map_iter_range, so the threads only read the map. The calling thread's range
+ * folds into acc itself, so acc's starting value counts once, and the others into copies
+ * of the identity, merged into acc in range order afterwards. With no room for the copies
+ * the calling thread does it all.
+ */
+
+typedef struct {
+    map_base_t *m;
+    MapVisitFunction visit;
+    void *acc;
+    size_t begin, end;
+} map_scan_worker_t;
+
+static void *map_scan_work(void *arg) {
+    map_scan_worker_t *w = (map_scan_worker_t *) arg;
+    map_iter_t it = map_iter_range_(w->begin, w->end);
+    void *key;
+    while ((key = map_next_(w->m, &it)) != NULL) {
+        w->visit(key, map_iter_value(w->m, &it), w->acc);
+    }
+    return NULL;
+}
+
+void map_parallel_reduce_(map_base_t *m, MapVisitFunction visit, MapMergeFunction merge, void *acc, const void *identity, size_t accsize, size_t nthreads) {
+    map_scan_worker_t workers[MAP_BULK_MAXTHREADS];
+    size_t i, perrange, span = map_iter_span_(m);
+    char *parts = NULL;
+    nthreads = map_bulk_threads(nthreads, m->nnodes);
+    if (nthreads > 1 && accsize > 0 && (parts = (char *) map_malloc(m, (nthreads - 1) * accsize)) == NULL) {
+        nthreads = 1;
+    }
+    perrange = (span + nthreads - 1) / nthreads;
+    for (i = 0; i < nthreads; i++) {
+        workers[i].m = m;
+        workers[i].visit = visit;
+        workers[i].begin = (i * perrange < span) ? i * perrange : span;
+        workers[i].end = (workers[i].begin + perrange < span) ? workers[i].begin + perrange : span;
+        workers[i].acc = acc;
+        if (i > 0 && parts != NULL) {
+            workers[i].acc = parts + (i - 1) * accsize;
+            memcpy(workers[i].acc, identity, accsize);
+        }
+    }
+    map_run_workers(map_scan_work, workers, sizeof(*workers), nthreads);
+    if (parts != NULL) {
+        for (i = 1; i < nthreads; i++) {
+            merge(acc, workers[i].acc);
+        }
+        map_free(m, parts);
+    }
+}
@@ -16,19 +16,116 @@
 
 typedef size_t (*MapHashFunction)(const void *key, size_t memsize);
 typedef int (*MapCmpFunction)(const void *a, const void *b, size_t memsize);
+typedef size_t (*MapSeedHashFunction)(const void *key, size_t memsize, size_t seed);
+typedef void (*MapCombineFunction)(void *dst_value, const void *src_value, size_t memsize);
+typedef void (*MapEvictFunction)(const void *key, void *value, void *udata);
+typedef void (*MapVisitFunction)(const void *key, void *value, void *acc);
+typedef void (*MapMergeFunction)(void *acc, const void *part);
+
+/* Entry of the chained engine, key and value live in the same allocation. See MAP_DECLARE */
+typedef struct map_node_t {
+    size_t hash;
+    void *key;
+    void *value;
+    struct map_node_t *next;
+} map_node_t;
+
+/* Memory callbacks used by a map instead of malloc/realloc/free, udata is passed to each call */
+typedef struct {
+    void *(*alloc)(void *udata, size_t size);
+    void *(*realloc)(void *udata, void *ptr, size_t size);
+    void (*free)(void *udata, void *ptr);
+    void *udata;
+} map_allocator_t;
+
+/* map_base_t.flags, storage engine and options */
+#define MAP_FLAT_ 0x1u
+#define MAP_POOL_ 0x2u
+#define MAP_INCREMENTAL_ 0x4u
+#define MAP_STRKEYS_ 0x8u
+#define MAP_FROZEN_ 0x10u
+#define MAP_MAPPED_ 0x20u
+#define MAP_DENSE_ 0x40u
+#define MAP_INTKEYS_ 0x80u
+#define MAP_CACHE_ 0x100u
+#define MAP_SMALL_ 0x200u
+
+/* Operation counters, only maintained when cmap.c is compiled with MAP_STATS defined.
+ * Cache maps always keep hits, misses and evictions, see map_init_cache */
+typedef struct {
+    size_t hits, misses, comparisons, resizes, evictions;
+    double resize_seconds;
+} map_counters_t;
 
-struct map_node_t;
+/* Entries whose lookup takes more probes than this are tallied in the last bin of map_stats_t.probes */
+#define MAP_STATS_NPROBES 16
+
+typedef struct {
+    size_t nnodes, nbuckets;
+    double load_factor;
+    /* probes[i]: entries found after i + 1 probed buckets, groups or slots, depending on the engine */
+    size_t probes[MAP_STATS_NPROBES];
+    size_t max_probe;
+    double avg_probe;
+    /* bucket arrays, indexes and control bytes vs. the nodes, slots or entries holding keys and values */
+    size_t bucket_bytes, node_bytes;
+    /* lookups is hits + misses, all counters stay 0 unless counting is set */
+    int counting;
+    size_t lookups;
+    map_counters_t counters;
+} map_stats_t;
 
 typedef struct {
     MapHashFunction hash_func;
     MapCmpFunction cmp_func;
+    /* used instead of hash_func when set, see map_init_seeded */
+    MapSeedHashFunction seed_hash_func;
+    size_t seed;
     size_t nbuckets, nnodes;
+    size_t ksize, vsize;
+    /* load factor bounds and the entry counts they give for nbuckets, see map_load_factor */
+    float maxload, minload;
+    size_t growat, shrinkat;
+    unsigned flags;
+    const map_allocator_t *allocator;
+    /* slab pool free list and chunk list, see map_init_pool */
+    void *pool_free, *pool_chunks;
+    /* bucket array being migrated from, see map_init_incremental */
+    struct map_node_t **oldbuckets;
+    size_t noldbuckets, migrated;
+    /* open addressing (flat) engine, see map_init_flat */
+    size_t ntombs, slotsize, slotvoff;
+    size_t *hashes;
+    unsigned char *ctrl;
+    /* perfect hash displacements of a frozen map, see map_freeze */
+    size_t *disps;
+    size_t ndisps, pseed;
+    /* file image a frozen map is read from, see map_open_mmap */
+    void *mapping;
+    size_t mapsize;
+    /* insertion ordered entry array of the dense engine, see map_init_dense */
+    char *entries;
+    size_t nentries, entcap, entsize, entkoff, entvoff;
+    /* entry limit and CLOCK hand of a cache, see map_init_cache */
+    size_t maxentries, hand;
+    MapEvictFunction evict_func;
+    void *evict_udata;
+    /* inline entry buffer of a map_small_t, as an offset from the map_base_t, and its size */
+    size_t smalloff, smallcap;
+    /* see map_stats */
+    map_counters_t counters;
+    /* bucket array, or the slot array of the flat engine.
+     * Keep last: nodes are laid out relative to this member, see map_boffset_ */
     struct map_node_t **buckets;
 } map_base_t;
 
 typedef struct {
     size_t bucketidx;
     struct map_node_t *node;
+    /* the chained entry map_next returned was removed by map_iter_remove */
+    int removed;
+    /* positions past this one aren't visited, see map_iter_range */
+    size_t end;
 } map_iter_t;
 
 #define map_pair_t(KT, VT) \
@@ -46,19 +143,166 @@ typedef struct {
         VT *valref;                       \
     }
 
-#define map_init(m, key_cmp_func, key_hash_func)                                        \
+/* map_t with room for N entries inline, laid out like the records of the dense engine */
+#define map_small_t(KT, VT, N)            \
+    struct {                              \
+        map_base_t base;                  \
+        KT tmpkey;                        \
+        VT tmpval;                        \
+        KT *keyref;                       \
+        VT *valref;                       \
+        struct {                          \
+            size_t hash, slot;            \
+            KT k;                         \
+            VT v;                         \
+        } smallbuf[N];                    \
+    }
+
+#define map_init_base_(b, key_size, value_size, key_cmp_func, key_hash_func)            \
     (void)(                                                                             \
-        (m)->base.nbuckets = 0,                                                         \
-        (m)->base.nnodes = 0,                                                           \
-        (m)->base.buckets = NULL,                                                       \
-        (m)->base.cmp_func = (key_cmp_func != NULL) ? key_cmp_func : map_generic_cmp,   \
-        (m)->base.hash_func = (key_hash_func != NULL) ? key_hash_func : map_generic_hash\
+        (b)->nbuckets = 0,                                                              \
+        (b)->nnodes = 0,                                                                \
+        (b)->buckets = NULL,                                                            \
+        (b)->ksize = (key_size),                                                        \
+        (b)->maxload = 1.0f,                                                            \
+        (b)->minload = 0.0f,                                                            \
+        (b)->growat = 0,                                                                \
+        (b)->shrinkat = 0,                                                              \
+        (b)->vsize = (value_size),                                                      \
+        (b)->flags = ((key_cmp_func) == NULL && (key_hash_func) == NULL                 \
+                      && map_intsize_(key_size)) ? MAP_INTKEYS_ : 0,                    \
+        (b)->seed_hash_func = NULL,                                                     \
+        (b)->seed = 0,                                                                  \
+        (b)->allocator = NULL,                                                          \
+        (b)->pool_free = NULL,                                                          \
+        (b)->pool_chunks = NULL,                                                        \
+        (b)->oldbuckets = NULL,                                                         \
+        (b)->noldbuckets = 0,                                                           \
+        (b)->migrated = 0,                                                              \
+        (b)->ntombs = 0,                                                                \
+        (b)->slotsize = 0,                                                              \
+        (b)->slotvoff = 0,                                                              \
+        (b)->hashes = NULL,                                                             \
+        (b)->ctrl = NULL,                                                               \
+        (b)->disps = NULL,                                                              \
+        (b)->ndisps = 0,                                                                \
+        (b)->pseed = 0,                                                                 \
+        (b)->mapping = NULL,                                                            \
+        (b)->mapsize = 0,                                                               \
+        (b)->entries = NULL,                                                            \
+        (b)->nentries = 0,                                                              \
+        (b)->entcap = 0,                                                                \
+        (b)->entsize = 0,                                                               \
+        (b)->entkoff = 0,                                                               \
+        (b)->entvoff = 0,                                                               \
+        (b)->maxentries = 0,                                                            \
+        (b)->hand = 0,                                                                  \
+        (b)->evict_func = NULL,                                                         \
+        (b)->evict_udata = NULL,                                                        \
+        (b)->smalloff = 0,                                                              \
+        (b)->smallcap = 0,                                                              \
+        (b)->counters.hits = 0,                                                         \
+        (b)->counters.misses = 0,                                                       \
+        (b)->counters.comparisons = 0,                                                  \
+        (b)->counters.resizes = 0,                                                      \
+        (b)->counters.evictions = 0,                                                    \
+        (b)->counters.resize_seconds = 0,                                               \
+        (b)->cmp_func = (key_cmp_func != NULL) ? key_cmp_func : map_generic_cmp,        \
+        (b)->hash_func = (key_hash_func != NULL) ? key_hash_func                        \
+                       : ((b)->flags & MAP_INTKEYS_) ? map_int_hash : map_generic_hash  \
     )
 
+#define map_init(m, key_cmp_func, key_hash_func) \
+    map_init_base_(&(m)->base, sizeof((m)->tmpkey), sizeof((m)->tmpval), key_cmp_func, key_hash_func)
+
 #define map_stdinit(m) map_init(m, NULL, NULL)
 
-#define map_delete(m)\
-  (map_delete_(&(m)->base), map_init(m, (m)->base.cmp_func, (m)->base.hash_func))
+#define map_init_flat(m, key_cmp_func, key_hash_func) \
+    (map_init(m, key_cmp_func, key_hash_func), (void)((m)->base.flags |= MAP_FLAT_))
+
+#define map_init_dense(m, key_cmp_func, key_hash_func) \
+    (map_init(m, key_cmp_func, key_hash_func), (void)((m)->base.flags |= MAP_DENSE_))
+
+#define map_init_small(m, key_cmp_func, key_hash_func)                                   \
+    (map_init_dense(m, key_cmp_func, key_hash_func),                                     \
+     (m)->base.entkoff = map_boffset_(&(m)->smallbuf[0].k, &(m)->smallbuf[0]),          \
+     (m)->base.entvoff = map_boffset_(&(m)->smallbuf[0].v, &(m)->smallbuf[0]),          \
+     (m)->base.entsize = sizeof((m)->smallbuf[0]),                                       \
+     (m)->base.smalloff = map_boffset_(&(m)->smallbuf[0], &(m)->base),                  \
+     (m)->base.smallcap = (m)->base.entcap = sizeof((m)->smallbuf) / sizeof((m)->smallbuf[0]), \
+     (void)((m)->base.flags |= MAP_SMALL_))
+
+#define map_init_cache(m, key_cmp_func, key_hash_func, max_entries) \
+    (map_init_dense(m, key_cmp_func, key_hash_func),                    \
+     (m)->base.maxentries = (max_entries),                              \
+     (void)((m)->base.flags |= MAP_CACHE_))
+
+#define map_on_evict(m, func, udata) \
+    ((m)->base.evict_func = (func), (void)((m)->base.evict_udata = (udata)))
+
+#define map_counters(m) \
+    ((m)->base.counters)
+
+#define map_init_alloc(m, key_cmp_func, key_hash_func, allocator_ptr) \
+    (map_init(m, key_cmp_func, key_hash_func), map_use_allocator(m, allocator_ptr))
+
+/* Only before the map allocated anything, i.e. right after one of the map_init* */
+#define map_use_allocator(m, allocator_ptr) \
+    ((void)((m)->base.allocator = (allocator_ptr)))
+
+#define map_init_pool(m, key_cmp_func, key_hash_func, allocator_ptr) \
+    (map_init_alloc(m, key_cmp_func, key_hash_func, allocator_ptr), (void)((m)->base.flags |= MAP_POOL_))
+
+#define map_init_incremental(m, key_cmp_func, key_hash_func) \
+    (map_init(m, key_cmp_func, key_hash_func), (void)((m)->base.flags |= MAP_INCREMENTAL_))
+
+#define map_init_seeded(m, key_cmp_func, key_seed_hash_func, hash_seed) \
+    (map_init(m, key_cmp_func, NULL),                                      \
+     (m)->base.flags = 0,                                                  \
+     (m)->base.hash_func = NULL,                                           \
+     (m)->base.seed_hash_func = (key_seed_hash_func),                      \
+     (void)((m)->base.seed = (hash_seed)))
+
+#define map_init_int(m)                                                                        \
+    (map_init(m, NULL, map_int_hash),                                                          \
+     (void)((m)->base.flags |= (sizeof((m)->tmpkey) <= sizeof(size_t)) ? MAP_INTKEYS_ : 0))
+
+#define map_init_strkeys(m, key_hash_func)                                                    \
+    (map_init(m, map_string_cmp, ((key_hash_func) != NULL ? (key_hash_func) : map_fast_string_hash)), \
+     (void)((m)->base.flags |= MAP_STRKEYS_))
+
+#define map_init_flat_strkeys(m, key_hash_func) \
+    (map_init_strkeys(m, key_hash_func), (void)((m)->base.flags |= MAP_FLAT_))
+
+#define map_init_dense_strkeys(m, key_hash_func) \
+    (map_init_strkeys(m, key_hash_func), (void)((m)->base.flags |= MAP_DENSE_))
+
+#define map_delete(m) \
+    map_delete_(&(m)->base)
+
+#define map_reserve(m, nentries) \
+    map_reserve_(&(m)->base, (nentries))
+
+#define map_shrink_to_fit(m) \
+    map_shrink_to_fit_(&(m)->base)
+
+#define map_load_factor(m, max_load, min_load) \
+    map_load_factor_(&(m)->base, (max_load), (min_load))
+
+#define map_stats(m, stats_ptr) \
+    map_stats_(&(m)->base, (stats_ptr))
+
+#define map_freeze(m) \
+    map_freeze_(&(m)->base)
+
+#define map_save(m, path) \
+    map_save_(&(m)->base, (path))
+
+#define map_open_mmap(m, path) \
+    map_open_mmap_(&(m)->base, (path))
+
+#define map_verify(m) \
+    map_verify_(&(m)->base)
 
 #define map_get(m, key) \
     ((m)->tmpkey = key, \
@@ -78,6 +322,79 @@ typedef struct {
     ((m)->tmpkey = (key),  \
      map_remove_(&(m)->base, &(m)->tmpkey, sizeof((m)->tmpkey)))
 
+#define map_get_or_insert(m, key, value, inserted)                 \
+    (                                                              \
+        (m)->tmpval = (value), (m)->tmpkey = (key),                \
+        (m)->valref = map_get_or_insert_(&(m)->base,               \
+                  &(m)->tmpkey, sizeof((m)->tmpkey),               \
+                  map_boffset_(&(m)->tmpkey, &(m)->base.buckets), \
+                  &(m)->tmpval, sizeof((m)->tmpval),               \
+                  map_boffset_(&(m)->tmpval, &(m)->base.buckets), \
+                  (inserted))                                      \
+    )
+
+#define map_keyhash(m, key) \
+    ((m)->tmpkey = (key),  \
+     map_keyhash_(&(m)->base, &(m)->tmpkey, sizeof((m)->tmpkey)))
+
+#define map_get_hashed(m, key, hash) \
+    ((m)->tmpkey = (key),            \
+     (m)->valref = map_get_hashed_(&(m)->base, &(m)->tmpkey, sizeof((m)->tmpkey), (hash)))
+
+#define map_set_hashed(m, key, hash, value)                        \
+    (                                                              \
+        (m)->tmpval = (value), (m)->tmpkey = (key),                \
+        map_set_hashed_(&(m)->base,                                \
+                  &(m)->tmpkey, sizeof((m)->tmpkey), (hash),       \
+                  map_boffset_(&(m)->tmpkey, &(m)->base.buckets), \
+                  &(m)->tmpval, sizeof((m)->tmpval),               \
+                  map_boffset_(&(m)->tmpval, &(m)->base.buckets)) \
+    )
+
+#define map_remove_hashed(m, key, hash) \
+    ((m)->tmpkey = (key),               \
+     map_remove_hashed_(&(m)->base, &(m)->tmpkey, sizeof((m)->tmpkey), (hash)))
+
+#define map_get_slice(m, str, len) \
+    ((m)->valref = map_get_slice_(&(m)->base, (str), (len)))
+
+#define map_set_slice(m, str, len, value)                          \
+    (                                                              \
+        (m)->tmpval = (value),                                     \
+        map_set_slice_(&(m)->base, (str), (len),                   \
+                  map_boffset_(&(m)->tmpkey, &(m)->base.buckets), \
+                  &(m)->tmpval, sizeof((m)->tmpval),               \
+                  map_boffset_(&(m)->tmpval, &(m)->base.buckets)) \
+    )
+
+#define map_remove_slice(m, str, len) \
+    map_remove_slice_(&(m)->base, (str), (len))
+
+#define map_get_many(m, count, keys, out)                      \
+    (                                                          \
+        map_sametype_(&(m)->tmpkey, (keys)),                   \
+        map_sametype_(&(m)->valref, (out)),                    \
+        map_get_many_(&(m)->base, (count), (keys),             \
+                      sizeof((m)->tmpkey), (void **) (out))    \
+    )
+
+#define map_set_many(m, count, keys, values)                             \
+    (                                                                    \
+        map_sametype_(&(m)->tmpkey, (keys)),                             \
+        map_sametype_(&(m)->tmpval, (values)),                           \
+        map_set_many_(&(m)->base, (count),                               \
+                      (keys), sizeof((m)->tmpkey),                       \
+                      map_boffset_(&(m)->tmpkey, &(m)->base.buckets),    \
+                      (values), sizeof((m)->tmpval),                     \
+                      map_boffset_(&(m)->tmpval, &(m)->base.buckets))    \
+    )
+
+#define map_remove_many(m, count, keys)                                      \
+    (                                                                        \
+        map_sametype_(&(m)->tmpkey, (keys)),                                 \
+        map_remove_many_(&(m)->base, (count), (keys), sizeof((m)->tmpkey))   \
+    )
+
 #define map_iter(m) \
     map_iter_()
 
@@ -88,6 +405,25 @@ typedef struct {
          : 0                                    \
     )
 
+#define map_iter_remove(m, iter) \
+    map_iter_remove_(&(m)->base, iter)
+
+#define map_iter_span(m) \
+    map_iter_span_(&(m)->base)
+
+#define map_iter_range(m, begin, end) \
+    map_iter_range_((begin), (end))
+
+#define map_parallel_for_each(m, visit_func, udata, nthreads) \
+    map_parallel_reduce_(&(m)->base, (visit_func), NULL, (udata), NULL, 0, (nthreads))
+
+#define map_parallel_reduce(m, visit_func, merge_func, acc, identity, nthreads)         \
+    (                                                                                  \
+        map_sametype_((acc), (identity)),                                              \
+        map_parallel_reduce_(&(m)->base, (visit_func), (merge_func), (acc), (identity), \
+                             sizeof(*(acc)), (nthreads))                               \
+    )
+
 #define map_equal(m1, m2, val_cmp_func)              \
     (                                                \
      map_sametype_(&(m1)->tmpkey, &(m2)->tmpkey),    \
@@ -116,6 +452,62 @@ typedef struct {
          : 1                                                                           \
     )
 
+#define map_merge(m1, m2, combine_func)                                  \
+    (                                                                    \
+        map_sametype_(&(m1)->tmpkey, &(m2)->tmpkey),                     \
+        map_sametype_(&(m1)->tmpval, &(m2)->tmpval),                     \
+        map_merge_(&(m1)->base, &(m2)->base,                             \
+                   sizeof((m1)->tmpkey),                                 \
+                   map_boffset_(&(m1)->tmpkey, &(m1)->base.buckets),     \
+                   sizeof((m1)->tmpval),                                 \
+                   map_boffset_(&(m1)->tmpval, &(m1)->base.buckets),     \
+                   (combine_func), 0)                                    \
+    )
+
+#define map_merge_move(m1, m2, combine_func)                             \
+    (                                                                    \
+        map_sametype_(&(m1)->tmpkey, &(m2)->tmpkey),                     \
+        map_sametype_(&(m1)->tmpval, &(m2)->tmpval),                     \
+        map_merge_(&(m1)->base, &(m2)->base,                             \
+                   sizeof((m1)->tmpkey),                                 \
+                   map_boffset_(&(m1)->tmpkey, &(m1)->base.buckets),     \
+                   sizeof((m1)->tmpval),                                 \
+                   map_boffset_(&(m1)->tmpval, &(m1)->base.buckets),     \
+                   (combine_func), 1)                                    \
+    )
+
+#define map_intersect(m1, m2)                                            \
+    (                                                                    \
+        map_sametype_(&(m1)->tmpkey, &(m2)->tmpkey),                     \
+        map_intersect_(&(m1)->base, &(m2)->base, sizeof((m1)->tmpkey))   \
+    )
+
+#define map_difference(m1, m2)                                           \
+    (                                                                    \
+        map_sametype_(&(m1)->tmpkey, &(m2)->tmpkey),                     \
+        map_difference_(&(m1)->base, &(m2)->base, sizeof((m1)->tmpkey))  \
+    )
+
+#define map_from_pairs_parallel(m, count, pairs, nthreads)                             \
+    (                                                                                  \
+        ((count) > 0)                                                                  \
+         ? (                                                                           \
+             map_sametype_(&(m)->tmpkey, &(pairs)->k),                                 \
+             map_sametype_(&(m)->tmpval, &(pairs)->v),                                 \
+             map_from_pairs_parallel_(&(m)->base,                                      \
+                             (count),                                                  \
+                             sizeof(*pairs),                                           \
+                             &(pairs)->k,                                              \
+                             sizeof((m)->tmpkey),                                      \
+                             map_boffset_(&(m)->tmpkey, &(m)->base.buckets),           \
+                             &(pairs)->v,                                              \
+                             sizeof((m)->tmpval),                                      \
+                             map_boffset_(&(m)->tmpval, &(m)->base.buckets),           \
+                             (nthreads) )                                              \
+           )                                                                           \
+         : 1                                                                           \
+    )
+
 /* copy from m2 into m1 */
 #define map_copy(m1, m2)                                             \
     (                                                                \
@@ -128,10 +520,72 @@ typedef struct {
                   map_boffset_(&(m2)->tmpval, &(m2)->base.buckets))  \
     )
 
+#define map_copy_parallel(m1, m2, nthreads)                          \
+    (                                                                \
+        map_sametype_(&(m1)->tmpkey, &(m2)->tmpkey),                 \
+        map_sametype_(&(m1)->tmpval, &(m2)->tmpval),                 \
+        map_copy_parallel_(&(m1)->base, &(m2)->base,                 \
+                  sizeof((m1)->tmpkey),                              \
+                  map_boffset_(&(m1)->tmpkey, &(m1)->base.buckets),  \
+                  sizeof((m1)->tmpval),                              \
+                  map_boffset_(&(m1)->tmpval, &(m1)->base.buckets),  \
+                  (nthreads))                                        \
+    )
+
+/* Key-only map on the flat engine: a slot holds the key and nothing else. See set_init */
+#define set_t(KT)                         \
+    struct {                              \
+        map_base_t base;                  \
+        KT tmpkey;                        \
+        KT *keyref;                       \
+    }
+
+#define set_init(s, key_cmp_func, key_hash_func)                                                 \
+    (map_init_base_(&(s)->base, sizeof((s)->tmpkey), 0, key_cmp_func, key_hash_func),           \
+     (void)((s)->base.flags |= MAP_FLAT_))
+
+#define set_stdinit(s) set_init(s, NULL, NULL)
+
+#define set_delete(s) \
+    map_delete_(&(s)->base)
+
+#define set_add(s, key)                                                       \
+    ((s)->tmpkey = (key),                                                     \
+     map_set_(&(s)->base, &(s)->tmpkey, sizeof((s)->tmpkey),                  \
+              map_boffset_(&(s)->tmpkey, &(s)->base.buckets), &(s)->tmpkey, 0, \
+              map_boffset_(&(s)->tmpkey, &(s)->base.buckets)))
+
+#define set_contains(s, key) \
+    ((s)->tmpkey = (key),    \
+     map_get_(&(s)->base, &(s)->tmpkey, sizeof((s)->tmpkey)) != NULL)
+
+#define set_remove(s, key) \
+    ((s)->tmpkey = (key),  \
+     map_remove_(&(s)->base, &(s)->tmpkey, sizeof((s)->tmpkey)))
+
+#define set_count(s) \
+    ((s)->base.nnodes)
+
+#define set_iter(s) \
+    map_iter_()
+
+#define set_next(s, iter, kptr) \
+    map_next(s, iter, kptr)
+
 size_t map_generic_hash(const void *mem, size_t memsize);
 
 size_t map_string_hash(const void *mem, size_t memsize);
 
+size_t map_fast_hash(const void *mem, size_t memsize);
+
+size_t map_fast_string_hash(const void *mem, size_t memsize);
+
+size_t map_fast_hash_seeded(const void *mem, size_t memsize, size_t seed);
+
+size_t map_fast_string_hash_seeded(const void *mem, size_t memsize, size_t seed);
+
+size_t map_int_hash(const void *mem, size_t memsize);
+
 int map_generic_cmp(const void *a, const void *b, size_t memsize);
 
 int map_string_cmp(const void *a, const void *b, size_t memsize);
@@ -140,26 +594,186 @@ int map_string_cmp(const void *a, const void *b, size_t memsize);
 /* "private" functions */
 void map_delete_(map_base_t *);
 
+int map_reserve_(map_base_t *, size_t);
+
+int map_shrink_to_fit_(map_base_t *);
+
+void map_load_factor_(map_base_t *, float, float);
+
+void map_stats_(map_base_t *, map_stats_t *);
+
+int map_freeze_(map_base_t *);
+
+int map_save_(map_base_t *, const char *);
+
+int map_open_mmap_(map_base_t *, const char *);
+
+int map_verify_(map_base_t *);
+
 void *map_get_(map_base_t *, const void *, size_t);
 
 int map_set_(map_base_t *, const void *, size_t, size_t, const void *, size_t, size_t);
 
 void map_remove_(map_base_t *, const void *, size_t);
 
+void *map_get_or_insert_(map_base_t *, const void *, size_t, size_t, const void *, size_t, size_t, int *);
+
+size_t map_keyhash_(map_base_t *, const void *, size_t);
+
+void *map_get_hashed_(map_base_t *, const void *, size_t, size_t);
+
+int map_set_hashed_(map_base_t *, const void *, size_t, size_t, size_t, const void *, size_t, size_t);
+
+void map_remove_hashed_(map_base_t *, const void *, size_t, size_t);
+
+int map_add_hashed_(map_base_t *, const void *, size_t, size_t, size_t, const void *, size_t, size_t);
+
+void *map_get_slice_(map_base_t *, const char *, size_t);
+
+int map_set_slice_(map_base_t *, const char *, size_t, size_t, const void *, size_t, size_t);
+
+void map_remove_slice_(map_base_t *, const char *, size_t);
+
+size_t map_get_many_(map_base_t *, size_t, const void *, size_t, void **);
+
+int map_set_many_(map_base_t *, size_t, const void *, size_t, size_t, const void *, size_t, size_t);
+
+void map_remove_many_(map_base_t *, size_t, const void *, size_t);
+
 map_iter_t map_iter_(void);
 
 void *map_next_(map_base_t *, map_iter_t *);
 
+int map_iter_remove_(map_base_t *, map_iter_t *);
+
+size_t map_iter_span_(map_base_t *);
+
+map_iter_t map_iter_range_(size_t, size_t);
+
+void map_parallel_reduce_(map_base_t *, MapVisitFunction, MapMergeFunction, void *, const void *, size_t, size_t);
+
 int map_equal_(map_base_t *, map_base_t *, size_t, size_t, MapCmpFunction);
 
 int map_from_pairs_(map_base_t *, size_t, size_t, const void *, size_t, size_t, const void *, size_t, size_t);
 
 int map_copy_(map_base_t *, map_base_t *, size_t, size_t, size_t, size_t);
 
+int map_merge_(map_base_t *, map_base_t *, size_t, size_t, size_t, size_t, MapCombineFunction, int);
+
+int map_intersect_(map_base_t *, map_base_t *, size_t);
+
+int map_difference_(map_base_t *, map_base_t *, size_t);
+
+int map_from_pairs_parallel_(map_base_t *, size_t, size_t, const void *, size_t, size_t, const void *, size_t, size_t, size_t);
+
+int map_copy_parallel_(map_base_t *, map_base_t *, size_t, size_t, size_t, size_t, size_t);
+
 #define map_boffset_(a, b) ((const char *)(a) - (const char *)(b))
 
 #define map_sametype_(a, b) ((void)((1) ? (a) : (b)))
 
+/* Key sizes map_init hashes with map_int_hash: 4 and 8 bytes that fit in a size_t. By size only,
+ * so doubles and small structs too, which is safe as equal hashes mean equal bytes */
+#define map_intsize_(ksize) (((ksize) == 4 || (ksize) == 8) && (ksize) <= sizeof(size_t))
+
+
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define MAP_INLINE static __inline
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+#define MAP_INLINE static inline
+#else
+#define MAP_INLINE static
+#endif
+
+/*
+ * Declares name##_t, a map_t(KT, VT), and functions specialized for it:
+ * name##_init, name##_get, name##_set and name##_remove, plus name##_hash_cb and name##_cmp_cb
+ * that wrap hash_fn and eq_fn for the generic code. hash_fn(key) returns a size_t hash of a KT,
+ * eq_fn(a, b) is non-zero when two KT are equal; both may be macros, so they get inlined.
+ * Lookups, overwrites and the search before an insert walk the buckets of chained maps right
+ * here. Other engines, resizes in progress and removals hash the key here once and hand the
+ * hash to the generic map_*_hashed code, which compares keys through name##_cmp_cb. Seeded
+ * maps, whose stored hashes don't come from hash_fn, take the plain generic path.
+ * The maps are ordinary maps: the map_* macros work on them too, as long as the map was
+ * set up with name##_init or with name##_cmp_cb and name##_hash_cb.
+ */
+#define MAP_DECLARE(name, KT, VT, hash_fn, eq_fn)                                        \
+    typedef map_t(KT, VT) name##_t;                                                      \
+                                                                                         \
+    MAP_INLINE size_t name##_hash_cb(const void *key, size_t memsize) {                  \
+        (void) memsize;                                                                  \
+        return (size_t) (hash_fn(*(const KT *) key));                                    \
+    }                                                                                    \
+                                                                                         \
+    MAP_INLINE int name##_cmp_cb(const void *a, const void *b, size_t memsize) {         \
+        (void) memsize;                                                                  \
+        return !(eq_fn(*(const KT *) a, *(const KT *) b));                               \
+    }                                                                                    \
+                                                                                         \
+    MAP_INLINE void name##_init(name##_t *m) {                                           \
+        map_init(m, name##_cmp_cb, name##_hash_cb);                                      \
+    }                                                                                    \
+                                                                                         \
+    /* Chain of the key's bucket if the map can be searched inline, else NULL */         \
+    MAP_INLINE map_node_t **name##_chain_(name##_t *m, size_t hash) {                    \
+        if ((m->base.flags & ~(unsigned) (MAP_POOL_ | MAP_INCREMENTAL_)) != 0           \
+            || m->base.oldbuckets != NULL || m->base.seed_hash_func != NULL) {            \
+            return NULL;                                                                 \
+        }                                                                                \
+        return &m->base.buckets[hash & (m->base.nbuckets - 1)];                          \
+    }                                                                                    \
+                                                                                         \
+    MAP_INLINE VT *name##_get(name##_t *m, KT key) {                                     \
+        size_t hash;                                                                     \
+        map_node_t **chain, *node;                                                       \
+        if (m->base.nbuckets == 0) {                                                     \
+            return NULL;                                                                 \
+        }                                                                                \
+        hash = (size_t) (hash_fn(key));                                                  \
+        if ((chain = name##_chain_(m, hash)) == NULL) {                                  \
+            return (m->base.seed_hash_func == NULL) ? map_get_hashed(m, key, hash)       \
+                                                    : map_get(m, key);                   \
+        }                                                                                \
+        for (node = *chain; node != NULL; node = node->next) {                           \
+            if (node->hash == hash && (eq_fn(*(KT *) node->key, key))) {                 \
+                return (VT *) node->value;                                               \
+            }                                                                            \
+        }                                                                                \
+        return NULL;                                                                     \
+    }                                                                                    \
+                                                                                         \
+    /* A key missing from the inline searched chain is added without searching again */ \
+    MAP_INLINE int name##_set(name##_t *m, KT key, VT value) {                           \
+        size_t hash;                                                                     \
+        map_node_t **chain, *node;                                                       \
+        if (m->base.seed_hash_func != NULL) {                                            \
+            return map_set(m, key, value);                                               \
+        }                                                                                \
+        hash = (size_t) (hash_fn(key));                                                  \
+        if (m->base.nbuckets == 0 || (chain = name##_chain_(m, hash)) == NULL) {         \
+            return map_set_hashed(m, key, hash, value);                                  \
+        }                                                                                \
+        for (node = *chain; node != NULL; node = node->next) {                           \
+            if (node->hash == hash && (eq_fn(*(KT *) node->key, key))) {                 \
+                *(VT *) node->value = value;                                             \
+                return 1;                                                                \
+            }                                                                            \
+        }                                                                                \
+        m->tmpkey = key;                                                                 \
+        m->tmpval = value;                                                               \
+        return map_add_hashed_(&m->base, &m->tmpkey, sizeof(m->tmpkey), hash,            \
+                               map_boffset_(&m->tmpkey, &m->base.buckets),               \
+                               &m->tmpval, sizeof(m->tmpval),                            \
+                               map_boffset_(&m->tmpval, &m->base.buckets));              \
+    }                                                                                    \
+                                                                                         \
+    MAP_INLINE void name##_remove(name##_t *m, KT key) {                                 \
+        if (m->base.seed_hash_func != NULL) {                                            \
+            map_remove(m, key);                                                          \
+        } else {                                                                         \
+            map_remove_hashed(m, key, (size_t) (hash_fn(key)));                          \
+        }                                                                                \
+    }
 
 /*typedef map_t(void *) map_void_t;
 typedef map_t(char *) map_str_t;
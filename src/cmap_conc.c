@@ -0,0 +1,460 @@
+/*************************************************************************
+ * Copyright (c) 2020 Wirtos
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h> /* malloc, free */
+#include <string.h> /* memcpy */
+#include "cmap_conc.h"
+
+/*
+ * Concurrent map. Readers take no locks: they walk the current table with acquire loads
+ * and only ever see fully built nodes, because a node is never changed once published
+ * (setting an existing key links a new node in place of the old one). Writers lock the
+ * stripe of the key's bucket; a resize takes every stripe, fills a new table with copies
+ * of the nodes and publishes it with a single store, so readers keep using the old one
+ * until they're done.
+ * Unlinked nodes and replaced tables are freed with epochs: a reader marks its per thread
+ * record with the global epoch while it's inside the map, and the epoch only advances
+ * when no reader is left in an older one. Memory retired in epoch e is freed once the
+ * epoch reaches e + 2.
+ */
+
+#define MAP_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define MAP_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+#define MAP_CONC_MINBUCKETS MAP_CONC_STRIPES
+
+/* Retired nodes a stripe collects before trying to advance the epoch */
+#define MAP_CONC_RECLAIM 64
+
+typedef struct map_conc_node_t map_conc_node_t;
+typedef struct map_conc_table_t map_conc_table_t;
+typedef struct map_conc_record_t map_conc_record_t;
+
+struct map_conc_node_t {
+    map_conc_node_t *next;
+    /* link in a retired list, next stays intact for readers still on the node */
+    map_conc_node_t *gcnext;
+    size_t hash;
+};
+
+struct map_conc_table_t {
+    size_t nbuckets;
+    size_t stamp;
+    map_conc_table_t *gcnext;
+    map_conc_node_t **buckets;
+};
+
+struct map_conc_record_t {
+    /* epoch the owner entered the map in, 0 while it's outside */
+    size_t epoch;
+    int owned;
+    map_conc_record_t *next;
+    char pad[MAP_CONC_LINE];
+};
+
+typedef union {
+    long double ld;
+    double d;
+    long l;
+    void *p;
+    void (*fp)(void);
+} map_conc_maxalign_t;
+
+/* Largest alignment an object of that size might need */
+static size_t map_conc_sizealign(size_t size) {
+    size_t a = size & (0 - size);
+    return (a == 0 || a > sizeof(map_conc_maxalign_t)) ? sizeof(map_conc_maxalign_t) : a;
+}
+
+static size_t map_conc_roundup(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+#define MAP_CONC_KEY(m, node) ((char *) (node) + (m)->koffset)
+#define MAP_CONC_VAL(m, node) ((char *) (node) + (m)->voffset)
+
+
+/*
+ * Epochs
+ */
+
+static void map_conc_release(void *rec) {
+    MAP_STORE(&((map_conc_record_t *) rec)->owned, 0);
+}
+
+/* Record of the calling thread, taking a released one or adding a new one on first use */
+static map_conc_record_t *map_conc_record(map_conc_base_t *m) {
+    map_conc_record_t *rec = (map_conc_record_t *) pthread_getspecific(m->reckey);
+    int unowned;
+    if (rec != NULL) {
+        return rec;
+    }
+    for (rec = MAP_LOAD(&m->records); rec != NULL; rec = rec->next) {
+        unowned = 0;
+        if (__atomic_compare_exchange_n(&rec->owned, &unowned, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (rec == NULL) {
+        if ((rec = (map_conc_record_t *) malloc(sizeof(*rec))) == NULL) {
+            return NULL;
+        }
+        rec->epoch = 0;
+        rec->owned = 1;
+        rec->next = MAP_LOAD(&m->records);
+        while (!__atomic_compare_exchange_n(&m->records, &rec->next, rec, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    if (pthread_setspecific(m->reckey, rec) != 0) {
+        map_conc_release(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+static void map_conc_enter(map_conc_base_t *m, map_conc_record_t *rec) {
+    /* Sequentially consistent, so a writer advancing the epoch either sees us or we see its unlinks */
+    __atomic_store_n(&rec->epoch, __atomic_load_n(&m->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void map_conc_leave(map_conc_record_t *rec) {
+    MAP_STORE(&rec->epoch, 0);
+}
+
+/* Advances the epoch if every reader inside the map is in the current one, returns the epoch */
+static size_t map_conc_advance(map_conc_base_t *m) {
+    size_t epoch = __atomic_load_n(&m->epoch, __ATOMIC_SEQ_CST), e;
+    map_conc_record_t *rec;
+    for (rec = MAP_LOAD(&m->records); rec != NULL; rec = rec->next) {
+        e = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST);
+        if (e != 0 && e != epoch) {
+            return epoch;
+        }
+    }
+    __atomic_compare_exchange_n(&m->epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&m->epoch, __ATOMIC_SEQ_CST);
+}
+
+static void map_conc_freenodes(map_conc_node_t *node) {
+    map_conc_node_t *next;
+    for (; node != NULL; node = next) {
+        next = node->gcnext;
+        free(node);
+    }
+}
+
+static void map_conc_freetable(map_conc_table_t *t) {
+    map_conc_node_t *node, *next;
+    size_t i;
+    for (i = 0; i < t->nbuckets; i++) {
+        for (node = t->buckets[i]; node != NULL; node = next) {
+            next = node->next;
+            free(node);
+        }
+    }
+    free(t);
+}
+
+/* Frees the replaced tables no reader can be on anymore */
+static void map_conc_reclaim_tables(map_conc_base_t *m) {
+    map_conc_table_t **ref, *t;
+    size_t epoch;
+    if (pthread_mutex_trylock(&m->gclock) != 0) {
+        return;
+    }
+    epoch = map_conc_advance(m);
+    for (ref = &m->oldtables; (t = *ref) != NULL;) {
+        if (t->stamp + 2 <= epoch) {
+            __atomic_store_n(ref, t->gcnext, __ATOMIC_RELAXED);
+            map_conc_freetable(t);
+        } else {
+            ref = &t->gcnext;
+        }
+    }
+    pthread_mutex_unlock(&m->gclock);
+}
+
+/* Frees the retired lists of the stripe that are at least 2 epochs old */
+static void map_conc_reclaim(map_conc_stripe_t *s, size_t epoch) {
+    size_t i;
+    for (i = 0; i < 3; i++) {
+        if (s->retired[i] != NULL && s->stamps[i] + 2 <= epoch) {
+            map_conc_freenodes(s->retired[i]);
+            s->retired[i] = NULL;
+        }
+    }
+    s->nretired = 0;
+}
+
+/* Queues an unlinked node, the stripe must be locked */
+static void map_conc_retire(map_conc_base_t *m, map_conc_stripe_t *s, map_conc_node_t *node) {
+    size_t epoch = __atomic_load_n(&m->epoch, __ATOMIC_SEQ_CST), i = epoch % 3;
+    if (s->stamps[i] != epoch) {
+        /* The list was filled 3 or more epochs ago */
+        map_conc_freenodes(s->retired[i]);
+        s->retired[i] = NULL;
+        s->stamps[i] = epoch;
+    }
+    node->gcnext = s->retired[i];
+    s->retired[i] = node;
+    if (++s->nretired >= MAP_CONC_RECLAIM) {
+        map_conc_reclaim(s, map_conc_advance(m));
+        if (__atomic_load_n(&m->oldtables, __ATOMIC_RELAXED) != NULL) {
+            map_conc_reclaim_tables(m);
+        }
+    }
+}
+
+
+/*
+ * Tables
+ */
+
+static map_conc_table_t *map_conc_newtable(size_t nbuckets) {
+    size_t hdr = map_conc_roundup(sizeof(map_conc_table_t), sizeof(map_conc_maxalign_t));
+    map_conc_table_t *t = (map_conc_table_t *) malloc(hdr + nbuckets * sizeof(*t->buckets));
+    size_t i;
+    if (t == NULL) {
+        return NULL;
+    }
+    t->nbuckets = nbuckets;
+    t->stamp = 0;
+    t->gcnext = NULL;
+    t->buckets = (map_conc_node_t **) ((char *) t + hdr);
+    for (i = 0; i < nbuckets; i++) {
+        t->buckets[i] = NULL;
+    }
+    return t;
+}
+
+static map_conc_stripe_t *map_conc_stripe(map_conc_base_t *m, size_t hash) {
+    /* Tables never have fewer buckets than stripes, so a bucket's keys share a stripe */
+    return &m->stripes[hash & (MAP_CONC_STRIPES - 1)];
+}
+
+/* Replaces the table with one twice as big, unless another writer already did */
+static void map_conc_grow(map_conc_base_t *m, map_conc_table_t *t) {
+    map_conc_table_t *nt = NULL;
+    map_conc_node_t *node, *copy, **bucket;
+    size_t i;
+    for (i = 0; i < MAP_CONC_STRIPES; i++) {
+        pthread_mutex_lock(&m->stripes[i].u.lock);
+    }
+    if (m->table != t || (nt = map_conc_newtable(t->nbuckets * 2)) == NULL) {
+        /* Failing to grow only makes chains longer */
+        goto unlock;
+    }
+    for (i = 0; i < t->nbuckets; i++) {
+        for (node = t->buckets[i]; node != NULL; node = node->next) {
+            if ((copy = (map_conc_node_t *) malloc(m->nodesize)) == NULL) {
+                map_conc_freetable(nt);
+                goto unlock;
+            }
+            memcpy(copy, node, m->nodesize);
+            bucket = &nt->buckets[copy->hash & (nt->nbuckets - 1)];
+            copy->next = *bucket;
+            *bucket = copy;
+        }
+    }
+    MAP_STORE(&m->table, nt);
+    /* Readers may still walk the old table, free it with its nodes later */
+    t->stamp = __atomic_load_n(&m->epoch, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&m->gclock);
+    t->gcnext = m->oldtables;
+    __atomic_store_n(&m->oldtables, t, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&m->gclock);
+unlock:
+    for (i = MAP_CONC_STRIPES; i--;) {
+        pthread_mutex_unlock(&m->stripes[i].u.lock);
+    }
+    if (nt != NULL) {
+        map_conc_reclaim_tables(m);
+    }
+}
+
+
+/*
+ * Public
+ */
+
+int map_conc_init_(map_conc_base_t *m, size_t ksize, size_t vsize, MapCmpFunction cmp_func, MapHashFunction hash_func) {
+    size_t i, j;
+    m->hash_func = hash_func;
+    m->cmp_func = cmp_func;
+    m->ksize = ksize;
+    m->vsize = vsize;
+    m->koffset = map_conc_roundup(sizeof(map_conc_node_t), map_conc_sizealign(ksize));
+    m->voffset = map_conc_roundup(m->koffset + ksize, map_conc_sizealign(vsize));
+    m->nodesize = m->voffset + vsize;
+    m->epoch = 1;
+    m->records = NULL;
+    m->oldtables = NULL;
+    if ((m->table = map_conc_newtable(MAP_CONC_MINBUCKETS)) == NULL) {
+        return 0;
+    }
+    if (pthread_key_create(&m->reckey, map_conc_release) != 0) {
+        goto fail_key;
+    }
+    if (pthread_mutex_init(&m->gclock, NULL) != 0) {
+        goto fail_gclock;
+    }
+    for (i = 0; i < MAP_CONC_STRIPES; i++) {
+        if (pthread_mutex_init(&m->stripes[i].u.lock, NULL) != 0) {
+            goto fail_stripes;
+        }
+        m->stripes[i].nnodes = 0;
+        m->stripes[i].nretired = 0;
+        for (j = 0; j < 3; j++) {
+            m->stripes[i].retired[j] = NULL;
+            m->stripes[i].stamps[j] = 0;
+        }
+    }
+    return 1;
+fail_stripes:
+    while (i--) {
+        pthread_mutex_destroy(&m->stripes[i].u.lock);
+    }
+    pthread_mutex_destroy(&m->gclock);
+fail_gclock:
+    pthread_key_delete(m->reckey);
+fail_key:
+    free(m->table);
+    m->table = NULL;
+    return 0;
+}
+
+
+void map_conc_delete_(map_conc_base_t *m) {
+    map_conc_record_t *rec, *nextrec;
+    map_conc_table_t *t, *nextt;
+    size_t i, j;
+    if (m->table == NULL) {
+        return;
+    }
+    for (i = 0; i < MAP_CONC_STRIPES; i++) {
+        for (j = 0; j < 3; j++) {
+            map_conc_freenodes(m->stripes[i].retired[j]);
+        }
+        pthread_mutex_destroy(&m->stripes[i].u.lock);
+    }
+    for (t = m->oldtables; t != NULL; t = nextt) {
+        nextt = t->gcnext;
+        map_conc_freetable(t);
+    }
+    map_conc_freetable(m->table);
+    m->table = NULL;
+    pthread_key_delete(m->reckey);
+    pthread_mutex_destroy(&m->gclock);
+    for (rec = m->records; rec != NULL; rec = nextrec) {
+        nextrec = rec->next;
+        free(rec);
+    }
+}
+
+
+int map_conc_get_(map_conc_base_t *m, const void *key, void *value) {
+    size_t hash = m->hash_func(key, m->ksize);
+    map_conc_record_t *rec = map_conc_record(m);
+    map_conc_stripe_t *s = NULL;
+    map_conc_table_t *t;
+    map_conc_node_t *node;
+    if (rec != NULL) {
+        map_conc_enter(m, rec);
+    } else {
+        /* Out of memory for a record: nothing changes or gets freed under the stripe lock */
+        s = map_conc_stripe(m, hash);
+        pthread_mutex_lock(&s->u.lock);
+    }
+    t = MAP_LOAD(&m->table);
+    for (node = MAP_LOAD(&t->buckets[hash & (t->nbuckets - 1)]); node != NULL; node = MAP_LOAD(&node->next)) {
+        if (node->hash == hash && m->cmp_func(key, MAP_CONC_KEY(m, node), m->ksize) == 0) {
+            if (value != NULL) {
+                memcpy(value, MAP_CONC_VAL(m, node), m->vsize);
+            }
+            break;
+        }
+    }
+    if (rec != NULL) {
+        map_conc_leave(rec);
+    } else {
+        pthread_mutex_unlock(&s->u.lock);
+    }
+    return node != NULL;
+}
+
+
+int map_conc_set_(map_conc_base_t *m, const void *key, const void *value) {
+    size_t hash = m->hash_func(key, m->ksize);
+    map_conc_stripe_t *s = map_conc_stripe(m, hash);
+    map_conc_node_t *node, *cur, **ref;
+    map_conc_table_t *t;
+    int grow = 0;
+    /* Built outside the lock, it's immutable once linked */
+    if ((node = (map_conc_node_t *) malloc(m->nodesize)) == NULL) {
+        return 0;
+    }
+    node->hash = hash;
+    node->gcnext = NULL;
+    memcpy(MAP_CONC_KEY(m, node), key, m->ksize);
+    memcpy(MAP_CONC_VAL(m, node), value, m->vsize);
+    pthread_mutex_lock(&s->u.lock);
+    /* A resize holds every stripe, the table can't change while we hold one */
+    t = m->table;
+    ref = &t->buckets[hash & (t->nbuckets - 1)];
+    for (; (cur = *ref) != NULL; ref = &cur->next) {
+        if (cur->hash == hash && m->cmp_func(key, MAP_CONC_KEY(m, cur), m->ksize) == 0) {
+            break;
+        }
+    }
+    if (cur != NULL) {
+        node->next = cur->next;
+        MAP_STORE(ref, node);
+        map_conc_retire(m, s, cur);
+    } else {
+        node->next = *ref;
+        MAP_STORE(ref, node);
+        __atomic_store_n(&s->nnodes, s->nnodes + 1, __ATOMIC_RELAXED);
+        grow = s->nnodes > t->nbuckets / MAP_CONC_STRIPES;
+    }
+    pthread_mutex_unlock(&s->u.lock);
+    if (grow) {
+        map_conc_grow(m, t);
+    }
+    return 1;
+}
+
+
+int map_conc_remove_(map_conc_base_t *m, const void *key) {
+    size_t hash = m->hash_func(key, m->ksize);
+    map_conc_stripe_t *s = map_conc_stripe(m, hash);
+    map_conc_node_t *cur, **ref;
+    map_conc_table_t *t;
+    pthread_mutex_lock(&s->u.lock);
+    t = m->table;
+    ref = &t->buckets[hash & (t->nbuckets - 1)];
+    for (; (cur = *ref) != NULL; ref = &cur->next) {
+        if (cur->hash == hash && m->cmp_func(key, MAP_CONC_KEY(m, cur), m->ksize) == 0) {
+            /* Readers on the node still find their way on through its next */
+            MAP_STORE(ref, cur->next);
+            __atomic_store_n(&s->nnodes, s->nnodes - 1, __ATOMIC_RELAXED);
+            map_conc_retire(m, s, cur);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->u.lock);
+    return cur != NULL;
+}
+
+
+size_t map_conc_count_(map_conc_base_t *m) {
+    size_t i, n = 0;
+    for (i = 0; i < MAP_CONC_STRIPES; i++) {
+        n += __atomic_load_n(&m->stripes[i].nnodes, __ATOMIC_RELAXED);
+    }
+    return n;
+}
@@ -0,0 +1,108 @@
+/*************************************************************************
+ * Copyright (c) 2020 Wirtos
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifndef CMAP_CONC_H
+#define CMAP_CONC_H
+
+#include <pthread.h> /* pthread_* */
+#include "cmap.h"    /* MapHashFunction, MapCmpFunction, map_generic_* */
+
+/* Lock stripes, a bucket is guarded by the stripe of its index. Power of two */
+#define MAP_CONC_STRIPES 64
+
+/* Assumed cache line size, stripes are padded to it */
+#define MAP_CONC_LINE 64
+
+struct map_conc_node_t;
+struct map_conc_table_t;
+struct map_conc_record_t;
+
+typedef struct {
+    union {
+        pthread_mutex_t lock;
+        char pad[MAP_CONC_LINE * ((sizeof(pthread_mutex_t) + MAP_CONC_LINE - 1) / MAP_CONC_LINE)];
+    } u;
+    /* entries in the buckets of this stripe */
+    size_t nnodes;
+    /* nodes waiting for readers to leave, one list per epoch modulo 3 */
+    struct map_conc_node_t *retired[3];
+    size_t stamps[3], nretired;
+} map_conc_stripe_t;
+
+typedef struct {
+    MapHashFunction hash_func;
+    MapCmpFunction cmp_func;
+    size_t ksize, vsize;
+    size_t koffset, voffset, nodesize;
+    /* current bucket table, replaced as a whole when growing */
+    struct map_conc_table_t *table;
+    /* global epoch and the per thread records of the readers, see map_conc_enter */
+    size_t epoch;
+    struct map_conc_record_t *records;
+    pthread_key_t reckey;
+    /* tables replaced by a resize, with their nodes */
+    pthread_mutex_t gclock;
+    struct map_conc_table_t *oldtables;
+    map_conc_stripe_t stripes[MAP_CONC_STRIPES];
+} map_conc_base_t;
+
+#define map_conc_t(KT, VT)      \
+    struct {                    \
+        map_conc_base_t base;   \
+        KT *keyref;             \
+        VT *valref;             \
+    }
+
+/* Picks the same default hash as map_init, see map_intsize_ */
+#define map_conc_init(m, key_cmp_func, key_hash_func)                                   \
+    map_conc_init_(&(m)->base, sizeof(*(m)->keyref), sizeof(*(m)->valref),              \
+                   (key_cmp_func != NULL) ? key_cmp_func : map_generic_cmp,             \
+                   (key_hash_func != NULL) ? key_hash_func                              \
+                   : ((key_cmp_func) == NULL && map_intsize_(sizeof(*(m)->keyref)))     \
+                     ? map_int_hash : map_generic_hash)
+
+#define map_conc_stdinit(m) map_conc_init(m, NULL, NULL)
+
+#define map_conc_delete(m) \
+    map_conc_delete_(&(m)->base)
+
+#define map_conc_get(m, key_ptr, value_ptr)                              \
+    (                                                                    \
+        map_sametype_((m)->keyref, (key_ptr)),                           \
+        map_sametype_((m)->valref, (value_ptr)),                         \
+        map_conc_get_(&(m)->base, (key_ptr), (value_ptr))                \
+    )
+
+#define map_conc_set(m, key_ptr, value_ptr)                              \
+    (                                                                    \
+        map_sametype_((m)->keyref, (key_ptr)),                           \
+        map_sametype_((m)->valref, (value_ptr)),                         \
+        map_conc_set_(&(m)->base, (key_ptr), (value_ptr))                \
+    )
+
+#define map_conc_remove(m, key_ptr)                                      \
+    (                                                                    \
+        map_sametype_((m)->keyref, (key_ptr)),                           \
+        map_conc_remove_(&(m)->base, (key_ptr))                          \
+    )
+
+#define map_conc_count(m) \
+    map_conc_count_(&(m)->base)
+
+int map_conc_init_(map_conc_base_t *, size_t, size_t, MapCmpFunction, MapHashFunction);
+
+void map_conc_delete_(map_conc_base_t *);
+
+int map_conc_get_(map_conc_base_t *, const void *, void *);
+
+int map_conc_set_(map_conc_base_t *, const void *, const void *);
+
+int map_conc_remove_(map_conc_base_t *, const void *);
+
+size_t map_conc_count_(map_conc_base_t *);
+
+#endif /* CMAP_CONC_H */
@@ -1,46 +1,116 @@
 #include <cmap.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include "test.h"
 
-#define test_section(desc)        \
-    {                             \
-        printf("--- %s\n", desc); \
-    }
-
-#define test_assermany_(last, cond, condstr)                                      \
-    {                                                                             \
-        static int failed_once__ = 0;                                             \
-        int pass__ = cond;                                                        \
-        if (!failed_once__ && (!pass__ || last)) {                                \
-            printf("[%s] %s:%d: ", pass__ ? "PASS" : "FAIL", __FILE__, __LINE__); \
-            printf((sizeof(condstr) > 50 ? "%.100s...\n" : "%s\n"), condstr);     \
-            if (pass__) {                                                         \
-                pass_count++;                                                     \
-            } else {                                                              \
-                fail_count++;                                                     \
-                failed_once__ = 1;                                                \
-            }                                                                     \
-        }                                                                         \
-    }                                                                             \
-    (void) 0
-
-#define test_assert(cond) \
-    test_assermany_(1, cond, #cond)
-
-#define test_assertmany(last, cond) \
-    test_assermany_(last, cond, #cond)
-
-#define test_print_res()                                                          \
-    {                                                                             \
-        printf("------------------------------------------------------------\n"); \
-        printf("-- Results:   %3d Total    %3d Passed    %3d Failed       --\n",  \
-               pass_count + fail_count, pass_count, fail_count);                  \
-        printf("------------------------------------------------------------\n"); \
-    }                                                                             \
-    (void) 0
-
-int pass_count = 0;
-int fail_count = 0;
+/* Allocator that counts live blocks in the size_t its udata points to */
+static void *count_alloc(void *udata, size_t size) {
+    ++*(size_t *) udata;
+    return malloc(size);
+}
+
+static void *count_realloc(void *udata, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        ++*(size_t *) udata;
+    }
+    return realloc(ptr, size);
+}
+
+static void count_free(void *udata, void *ptr) {
+    --*(size_t *) udata;
+    free(ptr);
+}
+
+/* String hash unknown to the map, slices have to be copied for it */
+static size_t first_char_hash(const void *mem, size_t memsize) {
+    (void) memsize;
+    return (unsigned char) **(const char **) mem;
+}
+
+static int int_cmp(const void *a, const void *b, size_t memsize) {
+    (void) memsize;
+    return *(const int *) a != *(const int *) b;
+}
+
+static size_t constant_hash(const void *mem, size_t memsize) {
+    (void) mem;
+    (void) memsize;
+    return 7;
+}
+
+static void int_add(void *dst, const void *src, size_t memsize) {
+    (void) memsize;
+    *(int *) dst += *(const int *) src;
+}
+
+/* Eviction callbacks: counts and sums the int keys into udata[0] and udata[1], frees the value */
+static void count_evicted(const void *key, void *value, void *udata) {
+    (void) value;
+    ((size_t *) udata)[0]++;
+    ((size_t *) udata)[1] += (size_t) *(const int *) key;
+}
+
+static void free_evicted(const void *key, void *value, void *udata) {
+    (void) key;
+    count_free(udata, *(char **) value);
+}
+
+/* Parallel scan callbacks over int keys and values: counting and summing, merged by adding */
+typedef struct {
+    size_t n;
+    long keys, vals;
+} int_sums_t;
+
+static void sum_visit(const void *key, void *value, void *acc) {
+    int_sums_t *sums = (int_sums_t *) acc;
+    sums->n++;
+    sums->keys += *(const int *) key;
+    sums->vals += (value != NULL) ? *(const int *) value : 0;
+}
+
+static void sum_merge(void *acc, const void *part) {
+    ((int_sums_t *) acc)->n += ((const int_sums_t *) part)->n;
+    ((int_sums_t *) acc)->keys += ((const int_sums_t *) part)->keys;
+    ((int_sums_t *) acc)->vals += ((const int_sums_t *) part)->vals;
+}
+
+static void double_visit(const void *key, void *value, void *udata) {
+    (void) key;
+    (void) udata;
+    *(int *) value *= 2;
+}
+
+/* Average length of the chain a key lands in when n keys with these hashes fill n buckets */
+static double chain_cost(const size_t *hashes, size_t n) {
+    static size_t load[4096];
+    size_t i, sq = 0;
+    memset(load, 0, sizeof(load));
+    for (i = 0; i < n; i++) {
+        load[hashes[i] & (n - 1)]++;
+    }
+    for (i = 0; i < n; i++) {
+        sq += load[i] * load[i];
+    }
+    return (double) sq / n;
+}
+
+/* Engine numbers of the loops running a test on every engine: chained, flat, dense, incremental */
+#define init_engine(m, key_cmp_func, key_hash_func, engine)                                     \
+    ((engine) == 1 ? map_init_flat(m, key_cmp_func, key_hash_func)                              \
+     : (engine) == 2 ? map_init_dense(m, key_cmp_func, key_hash_func)                           \
+     : (engine) == 3 ? map_init_incremental(m, key_cmp_func, key_hash_func)                     \
+     : (void) map_init(m, key_cmp_func, key_hash_func))
+
+#define IDENT_HASH(k) ((size_t) (unsigned) (k) * 2654435761u)
+#define INT_EQ(a, b) ((a) == (b))
+
+MAP_DECLARE(imap, int, long, IDENT_HASH, INT_EQ)
+
+/* Same, counting how often the specialized functions hash */
+static size_t nhashed;
+#define COUNTED_HASH(k) (nhashed++, IDENT_HASH(k))
+MAP_DECLARE(countmap, int, long, COUNTED_HASH, INT_EQ)
 
 typedef map_t(double, int) map_lf_i;
 typedef map_t(const char *, const char *) map_s_s;
@@ -56,7 +126,7 @@ int main() {
         test_assert(m.base.nnodes == 0);
         test_assert(m.base.nbuckets == 0);
         test_assert(m.base.cmp_func == map_generic_cmp);
-        test_assert(m.base.hash_func == map_generic_hash);
+        test_assert(m.base.hash_func == map_int_hash && (m.base.flags & MAP_INTKEYS_));
         test_assert(ms.base.cmp_func == map_string_cmp);
         test_assert(ms.base.hash_func == map_string_hash);
     }
@@ -129,6 +199,1316 @@ int main() {
         map_delete(cpmp);
     }
 
+    test_section("map_init_flat") {
+        map_lf_i fm, chained, *fmp = &fm, *cmp = &chained;
+        map_s_s fms, *fmsp = &fms;
+        map_iter_t it;
+        double key;
+        size_t c = 0;
+        int k, odd = 1;
+        map_init_flat(fmp, NULL, NULL);
+        for (k = 0; k < 1000; k++) {
+            test_assertmany(k == 999, map_set(fmp, k, k) && map_set(fmp, k, k + 1));
+        }
+        test_assert(fm.base.nnodes == 1000);
+        for (k = 0; k < 1000; k++) {
+            test_assertmany(k == 999, map_get(fmp, k) && *map_get(fmp, k) == k + 1);
+        }
+        test_assert(map_get(fmp, 1000) == NULL);
+        for (k = 0; k < 1000; k += 2) {
+            map_remove(fmp, k);
+        }
+        for (k = 0; k < 1000; k++) {
+            test_assertmany(k == 999, (map_get(fmp, k) != NULL) == (k % 2 == 1));
+        }
+        it = map_iter(fmp);
+        while (map_next(fmp, &it, &key)) {
+            odd &= ((int) key % 2 == 1);
+            c++;
+        }
+        test_assert(odd && c == 500);
+        for (k = 0; k < 1000; k += 2) {
+            test_assertmany(k == 998, map_set(fmp, k, k + 1));
+        }
+        test_assert(fm.base.nnodes == 1000);
+
+        map_stdinit(cmp);
+        test_assert(map_copy(cmp, fmp));
+        test_assert(map_equal(cmp, fmp, NULL) && map_equal(fmp, cmp, NULL));
+        map_remove(fmp, 500);
+        test_assert(!map_equal(cmp, fmp, NULL));
+        map_delete(cmp);
+        map_delete(fmp);
+        test_assert(fm.base.nnodes == 0 && fm.base.nbuckets == 0 && map_get(fmp, 1) == NULL);
+
+        map_init_flat(fmsp, map_string_cmp, map_string_hash);
+        test_assert(map_set(fmsp, "key", "value") && map_set(fmsp, "other", "value2"));
+        test_assert(map_get(fmsp, "key") && strcmp(*map_get(fmsp, "key"), "value") == 0);
+        test_assert(map_get(fmsp, "missing") == NULL);
+        map_delete(fmsp);
+    }
+
+    test_section("map_init_alloc|map_init_pool") {
+        map_lf_i am, pm, *amp = &am, *pmp = &pm;
+        size_t alive = 0;
+        map_allocator_t counter;
+        int k;
+        counter.alloc = count_alloc;
+        counter.realloc = count_realloc;
+        counter.free = count_free;
+        counter.udata = &alive;
+
+        map_init_alloc(amp, NULL, NULL, &counter);
+        for (k = 0; k < 100; k++) {
+            test_assertmany(k == 99, map_set(amp, k, k));
+        }
+        test_assert(alive == 101); /* nodes and the bucket array */
+        map_remove(amp, 0);
+        test_assert(alive == 100);
+        map_delete(amp);
+        test_assert(alive == 0);
+
+        map_init_pool(pmp, NULL, NULL, &counter);
+        for (k = 0; k < 1000; k++) {
+            test_assertmany(k == 999, map_set(pmp, k, k));
+        }
+        test_assert(alive > 1 && alive < 100);
+        for (k = 0; k < 1000; k += 2) {
+            map_remove(pmp, k);
+        }
+        for (k = 0; k < 1000; k++) {
+            test_assertmany(k == 999, (map_get(pmp, k) != NULL) == (k % 2 == 1));
+        }
+        alive = 0; /* reinserting reuses removed nodes, nothing new is allocated */
+        for (k = 0; k < 1000; k += 2) {
+            test_assertmany(k == 998, map_set(pmp, k, -k) && *map_get(pmp, k) == -k);
+        }
+        test_assert(alive == 0);
+        map_delete(pmp);
+        test_assert(pm.base.nnodes == 0 && map_get(pmp, 1) == NULL);
+        test_assert(map_set(pmp, 1, 1) && *map_get(pmp, 1) == 1);
+        map_delete(pmp);
+    }
+
+    test_section("map_init_incremental") {
+        map_lf_i im, *imp = &im;
+        map_iter_t it;
+        double key;
+        double sum = 0;
+        size_t c = 0, i;
+        int k = 0;
+        map_init_incremental(imp, NULL, NULL);
+        /* Stop right after a resize has started */
+        do {
+            test_assertmany(0, map_set(imp, k, k));
+            k++;
+        } while (im.base.oldbuckets == NULL || im.base.noldbuckets < 1024);
+        test_assert(im.base.migrated == 0 && im.base.nbuckets == 2 * im.base.noldbuckets);
+        test_assert(map_get(imp, 0) && *map_get(imp, 0) == 0);
+        test_assert(im.base.migrated > 0 && im.base.oldbuckets != NULL);
+        map_remove(imp, 1);
+        test_assert(map_get(imp, 1) == NULL && im.base.nnodes == (size_t) k - 1);
+        test_assert(map_set(imp, 1, 1) && map_set(imp, 1, 2) && *map_get(imp, 1) == 2);
+        test_assert(im.base.oldbuckets != NULL);
+        /* migrated old buckets are left empty, the rest hold the entries not moved yet */
+        for (i = 0; i < im.base.noldbuckets; i++) {
+            test_assertmany(i == im.base.noldbuckets - 1, i >= im.base.migrated || im.base.oldbuckets[i] == NULL);
+        }
+        /* Every key is visited once even though the resize is still pending */
+        it = map_iter(imp);
+        while (map_next(imp, &it, &key)) {
+            sum += key;
+            c++;
+            test_assertmany(c == (size_t) k, map_get(imp, key) && *map_get(imp, key) == (key == 1 ? 2 : key));
+        }
+        test_assert(c == im.base.nnodes && sum == (double) k * (k - 1) / 2);
+        test_assert(im.base.oldbuckets == NULL);
+        for (; k < 10000; k++) {
+            test_assertmany(k == 9999, map_set(imp, k, k));
+        }
+        for (k = 2; k < 10000; k++) {
+            test_assertmany(k == 9999, map_get(imp, k) && *map_get(imp, k) == k);
+        }
+        map_delete(imp);
+        test_assert(im.base.oldbuckets == NULL && im.base.nnodes == 0);
+    }
+
+    test_section("map_fast_hash|map_init_seeded") {
+        static size_t djb2[4096], fast[4096];
+        struct { int a, b, c, d; } rec;
+        char buf[32], *str = buf;
+        size_t i, n = 4096;
+        map_lf_i sm, *smp = &sm;
+        map_s_s ssm, *ssmp = &ssm;
+        int k;
+        /* 16 byte records and strings sharing a prefix: djb2 crowds them into fewer buckets */
+        for (i = 0; i < n; i++) {
+            rec.a = (int) (i % 64), rec.b = 0, rec.c = (int) (i / 64), rec.d = 7;
+            djb2[i] = map_generic_hash(&rec, sizeof(rec));
+            fast[i] = map_fast_hash(&rec, sizeof(rec));
+        }
+        test_assert(chain_cost(fast, n) < chain_cost(djb2, n) && chain_cost(fast, n) < 2.5);
+        for (i = 0; i < n; i++) {
+            sprintf(buf, "metric_label_%lu", (unsigned long) i);
+            djb2[i] = map_string_hash(&str, sizeof(str));
+            fast[i] = map_fast_string_hash(&str, sizeof(str));
+            test_assertmany(i == n - 1, fast[i] == map_fast_hash(buf, strlen(buf)));
+        }
+        test_assert(chain_cost(fast, n) < chain_cost(djb2, n) && chain_cost(fast, n) < 2.5);
+        test_assert(map_fast_hash_seeded(&rec, sizeof(rec), 1) != map_fast_hash_seeded(&rec, sizeof(rec), 2));
+        test_assert(map_fast_hash_seeded(buf, 4, 0) != map_fast_hash_seeded(buf, 5, 0));
+
+        map_init_seeded(smp, NULL, map_fast_hash_seeded, 0x5eed);
+        for (k = 0; k < 1000; k++) {
+            test_assertmany(k == 999, map_set(smp, k, k));
+        }
+        for (k = 0; k < 1000; k++) {
+            test_assertmany(k == 999, map_get(smp, k) && *map_get(smp, k) == k);
+        }
+        map_delete(smp);
+        map_init_seeded(ssmp, map_string_cmp, map_fast_string_hash_seeded, 42);
+        test_assert(map_set(ssmp, "key", "value") && strcmp(*map_get(ssmp, "key"), "value") == 0);
+        test_assert(map_get(ssmp, "kez") == NULL);
+        map_delete(ssmp);
+    }
+
+    test_section("map_init_strkeys") {
+        map_t(char *, int) om, fom, *omp = &om, *fomp = &fom;
+        char buf[32], *key, *keys = "";
+        map_iter_t it;
+        int i, flat, sum;
+        map_init_strkeys(omp, NULL);
+        map_init_flat_strkeys(fomp, map_string_hash); /* owned keys in slots of the flat engine */
+        for (flat = 0; flat < 2; flat++) {
+            omp = flat ? fomp : &om;
+            for (i = 0; i < 100; i++) {
+                sprintf(buf, "header-%d", i);
+                test_assertmany(i == 99, map_set(omp, buf, i));
+            }
+            strcpy(buf, "scratch"); /* keys were copied */
+            test_assert(map_get(omp, "header-0") && *map_get(omp, "header-0") == 0);
+            test_assert(map_get(omp, "header-99") && *map_get(omp, "header-99") == 99);
+            test_assert(map_get(omp, "header-1") && *map_get(omp, "header-1") == 1);
+            test_assert(map_get(omp, "header-") == NULL && map_get(omp, "header-100") == NULL);
+            test_assert(map_get(omp, "scratch") == NULL);
+            test_assert(map_set(omp, "header-5", -5) && *map_get(omp, "header-5") == -5 && omp->base.nnodes == 100);
+            map_remove(omp, "header-5");
+            test_assert(map_get(omp, "header-5") == NULL && omp->base.nnodes == 99);
+            it = map_iter(omp);
+            sum = 0;
+            while (map_next(omp, &it, &key)) {
+                test_assertmany(0, strncmp(key, "header-", 7) == 0 && *map_get(omp, key) == atoi(key + 7));
+                sum += atoi(key + 7);
+                keys = key;
+            }
+            test_assert(sum == 99 * 100 / 2 - 5 && keys != buf);
+            map_delete(omp);
+        }
+    }
+
+    test_section("map_get_slice|map_set_slice|map_remove_slice") {
+        map_s_s sm1, sm2, sm3, *sms[3];
+        map_t(char *, int) om, *omp = &om;
+        const char *packet = "GET /index.html HTTP/1.1\r\nHost: example.com\r\n";
+        static char longkey[1000];
+        int i;
+        sms[0] = &sm1, sms[1] = &sm2, sms[2] = &sm3;
+        map_init(sms[0], map_string_cmp, map_string_hash);
+        map_init(sms[1], map_string_cmp, map_fast_string_hash);
+        map_init(sms[2], map_string_cmp, first_char_hash);
+        memset(longkey, 'k', sizeof(longkey) - 1);
+        for (i = 0; i < 3; i++) {
+            test_assertmany(i == 2, map_set(sms[i], "Host", "h") && map_set(sms[i], "GET", "g"));
+            test_assertmany(i == 2, map_set(sms[i], "H", "x") && map_set(sms[i], longkey, "long"));
+            test_assertmany(i == 2, map_get_slice(sms[i], packet, 3) && **map_get_slice(sms[i], packet, 3) == 'g');
+            test_assertmany(i == 2, map_get_slice(sms[i], packet + 26, 4) && **map_get_slice(sms[i], packet + 26, 4) == 'h');
+            test_assertmany(i == 2, map_get_slice(sms[i], packet + 26, 1) && **map_get_slice(sms[i], packet + 26, 1) == 'x');
+            test_assertmany(i == 2, map_get_slice(sms[i], packet + 26, 3) == NULL && map_get_slice(sms[i], packet, 2) == NULL);
+            test_assertmany(i == 2, map_get_slice(sms[i], longkey, sizeof(longkey) - 1) != NULL);
+            test_assertmany(i == 2, map_get_slice(sms[i], longkey, sizeof(longkey) - 2) == NULL);
+            test_assertmany(i == 2, !map_set_slice(sms[i], packet, 3, "not owned"));
+            map_remove_slice(sms[i], packet + 26, 4);
+            test_assertmany(i == 2, map_get(sms[i], "Host") == NULL && map_get(sms[i], "H") != NULL);
+            map_delete(sms[i]);
+        }
+
+        map_init_strkeys(omp, NULL);
+        test_assert(map_set_slice(omp, packet + 26, 4, 1) && map_set_slice(omp, packet, 3, 2));
+        test_assert(map_get(omp, "Host") && *map_get(omp, "Host") == 1);
+        test_assert(map_get_slice(omp, packet, 3) && *map_get_slice(omp, packet, 3) == 2);
+        test_assert(map_set_slice(omp, "Host", 4, 3) && *map_get(omp, "Host") == 3 && om.base.nnodes == 2);
+        map_remove_slice(omp, packet, 3);
+        test_assert(map_get(omp, "GET") == NULL && om.base.nnodes == 1);
+        map_delete(omp);
+    }
+
+    test_section("map_reserve|map_load_factor|map_shrink_to_fit") {
+        map_lf_i rm, fm, im, *rmp = &rm, *fmp = &fm, *imp = &im, *maps[3];
+        size_t nbuckets;
+        int i, k;
+        map_stdinit(rmp);
+        map_init_flat(fmp, NULL, NULL);
+        map_init_incremental(imp, NULL, NULL);
+        maps[0] = rmp, maps[1] = fmp, maps[2] = imp;
+        for (i = 0; i < 3; i++) {
+            test_assertmany(i == 2, map_reserve(maps[i], 1000));
+            nbuckets = maps[i]->base.nbuckets;
+            for (k = 0; k < 1000; k++) {
+                test_assertmany(0, map_set(maps[i], k, k));
+            }
+            test_assertmany(i == 2, maps[i]->base.nbuckets == nbuckets && maps[i]->base.nnodes == 1000);
+            test_assertmany(i == 2, map_reserve(maps[i], 10) && maps[i]->base.nbuckets == nbuckets);
+            for (k = 3; k < 1000; k++) {
+                map_remove(maps[i], k);
+            }
+            test_assertmany(i == 2, maps[i]->base.nbuckets == nbuckets);
+            test_assertmany(i == 2, map_shrink_to_fit(maps[i]) && maps[i]->base.nbuckets == (i == 1 ? 16 : 4));
+            test_assertmany(i == 2, map_get(maps[i], 2) && *map_get(maps[i], 2) == 2 && map_get(maps[i], 3) == NULL);
+            map_remove(maps[i], 0), map_remove(maps[i], 1), map_remove(maps[i], 2);
+            test_assertmany(i == 2, map_shrink_to_fit(maps[i]) && maps[i]->base.nbuckets == 0);
+
+            /* Grow at half load, shrink below an eighth of it */
+            map_load_factor(maps[i], 0.5f, 0.125f);
+            for (k = 0; k < 1000; k++) {
+                test_assertmany(0, map_set(maps[i], k, k));
+                test_assertmany(0, maps[i]->base.nnodes * 2 <= maps[i]->base.nbuckets);
+            }
+            nbuckets = maps[i]->base.nbuckets;
+            test_assertmany(i == 2, nbuckets == 2048);
+            for (k = 0; k < 990; k++) {
+                map_remove(maps[i], k);
+                test_assertmany(0, maps[i]->base.nnodes * 8 >= maps[i]->base.nbuckets || maps[i]->base.nnodes < 2);
+            }
+            test_assertmany(i == 2, maps[i]->base.nbuckets <= nbuckets / 32);
+            for (k = 990; k < 1000; k++) {
+                test_assertmany((k == 999 && i == 2), map_get(maps[i], k) && *map_get(maps[i], k) == k);
+            }
+            map_delete(maps[i]);
+        }
+    }
+
+    test_section("map_get_many|map_set_many|map_remove_many") {
+        map_lf_i bm, fm, *maps[2];
+        map_t(char *, int) om;
+        static double keys[1000];
+        static int values[1000], *out[1000];
+        char *skeys[3];
+        int *sout[3];
+        int i, k, ok;
+        map_stdinit(&bm);
+        map_init_flat(&fm, NULL, NULL);
+        maps[0] = &bm, maps[1] = &fm;
+        for (k = 0; k < 1000; k++) {
+            keys[k] = k, values[k] = -k;
+        }
+        for (i = 0; i < 2; i++) {
+            test_assertmany(i == 1, map_set_many(maps[i], 500, keys, values) && maps[i]->base.nnodes == 500);
+            test_assertmany(i == 1, map_set_many(maps[i], 1000, keys, values) && maps[i]->base.nnodes == 1000);
+            map_remove_many(maps[i], 250, keys + 500);
+            test_assertmany(i == 1, maps[i]->base.nnodes == 750);
+            test_assertmany(i == 1, map_get_many(maps[i], 1000, keys, out) == 750);
+            for (k = 0, ok = 1; k < 1000; k++) {
+                ok &= (k >= 500 && k < 750) ? out[k] == NULL : (out[k] && *out[k] == -k);
+            }
+            test_assertmany(i == 1, ok);
+            test_assertmany(i == 1, map_get_many(maps[i], 0, keys, out) == 0);
+            map_delete(maps[i]);
+        }
+
+        map_init_strkeys(&om, NULL);
+        skeys[0] = "a", skeys[1] = "bb", skeys[2] = "ccc";
+        test_assert(map_set_many(&om, 3, skeys, values + 1));
+        skeys[1] = "missing";
+        test_assert(map_get_many(&om, 3, skeys, sout) == 2);
+        test_assert(sout[0] && *sout[0] == -1 && sout[1] == NULL && sout[2] && *sout[2] == -3);
+        map_delete(&om);
+    }
+
+    test_section("map_get_or_insert|map_keyhash|map_get_hashed|map_set_hashed|map_remove_hashed") {
+        map_lf_i bm, fm, *maps[2];
+        map_t(char *, int) om;
+        int i, k, inserted, ok, *ref;
+        size_t hash;
+        map_stdinit(&bm);
+        map_init_flat(&fm, NULL, NULL);
+        maps[0] = &bm, maps[1] = &fm;
+        for (i = 0; i < 2; i++) {
+            for (k = 0, ok = 1; k < 300; k++) {
+                ref = map_get_or_insert(maps[i], k % 100, 0, &inserted);
+                ok &= ref != NULL && inserted == (k < 100);
+                if (ref) {
+                    (*ref)++;
+                }
+            }
+            test_assertmany(i == 1, ok && maps[i]->base.nnodes == 100);
+            test_assertmany(i == 1, map_get(maps[i], 42) && *map_get(maps[i], 42) == 3);
+            test_assertmany(i == 1, map_get_or_insert(maps[i], 42, 7, NULL) && *maps[i]->valref == 3);
+
+            hash = map_keyhash(maps[i], 500);
+            test_assertmany(i == 1, map_get_hashed(maps[i], 500, hash) == NULL);
+            test_assertmany(i == 1, map_set_hashed(maps[i], 500, hash, 5) && *map_get(maps[i], 500) == 5);
+            test_assertmany(i == 1, map_get_hashed(maps[i], 500, hash) && *maps[i]->valref == 5);
+            map_remove_hashed(maps[i], 500, hash);
+            test_assertmany(i == 1, map_get(maps[i], 500) == NULL && maps[i]->base.nnodes == 100);
+            map_delete(maps[i]);
+        }
+
+        map_init_strkeys(&om, NULL);
+        test_assert(map_get_or_insert(&om, "key", 1, &inserted) && inserted);
+        test_assert(map_get_or_insert(&om, "key", 2, &inserted) && !inserted && *om.valref == 1);
+        hash = map_keyhash(&om, "key");
+        test_assert(map_get_hashed(&om, "key", hash) && *om.valref == 1);
+        map_delete(&om);
+    }
+
+    test_section("map_freeze") {
+        map_lf_i bm, fm, im, pm, *maps[4];
+        map_t(char *, int) om;
+        map_t(int, char) cm;
+        static double keys[5000];
+        static int *out[5000];
+        char buf[16], *key;
+        double k;
+        map_iter_t iter;
+        int i, n, ok, count, sizes[4] = {0, 1, 3, 5000};
+        for (n = 0; n < 5000; n++) {
+            keys[n] = n * 1.5;
+        }
+        for (n = 0; n < 4; n++) {
+            map_stdinit(&bm);
+            map_init_flat(&fm, NULL, NULL);
+            map_init_incremental(&im, NULL, NULL);
+            map_init_pool(&pm, NULL, NULL, NULL);
+            maps[0] = &bm, maps[1] = &fm, maps[2] = &im, maps[3] = &pm;
+            for (i = 0; i < 4; i++) {
+                for (count = 0; count < sizes[n]; count++) {
+                    map_set(maps[i], keys[count], count);
+                }
+                map_remove(maps[i], -1.0);
+                test_assertmany((n == 3 && i == 3), map_freeze(maps[i]) && map_freeze(maps[i]));
+                test_assertmany((n == 3 && i == 3), maps[i]->base.nnodes == (size_t) sizes[n] && maps[i]->base.nbuckets == (size_t) sizes[n]);
+                for (count = 0, ok = 1; count < sizes[n]; count++) {
+                    ok &= map_get(maps[i], keys[count]) && *maps[i]->valref == count;
+                    ok &= map_get(maps[i], keys[count] + 0.25) == NULL;
+                }
+                test_assertmany((n == 3 && i == 3), ok && map_get(maps[i], -1.0) == NULL);
+                test_assertmany((n == 3 && i == 3), !map_set(maps[i], -1.0, 1) && map_get(maps[i], -1.0) == NULL);
+                map_remove(maps[i], keys[0]);
+                test_assertmany((n == 3 && i == 3), maps[i]->base.nnodes == (size_t) sizes[n]);
+                test_assertmany((n == 3 && i == 3), map_get_many(maps[i], sizes[n], keys, out) == (size_t) sizes[n]);
+                iter = map_iter(maps[i]);
+                for (count = 0, ok = 1; map_next(maps[i], &iter, &k); count++) {
+                    ok &= map_get(maps[i], k) && *maps[i]->valref == (int) (k / 1.5);
+                }
+                test_assertmany((n == 3 && i == 3), ok && count == sizes[n]);
+                /* Deleting thaws the map back into its engine */
+                map_delete(maps[i]);
+                test_assertmany((n == 3 && i == 3), map_set(maps[i], 2.0, 2) && *map_get(maps[i], 2.0) == 2);
+                map_delete(maps[i]);
+            }
+        }
+
+        map_init_strkeys(&om, NULL);
+        for (i = 0, ok = 1; i < 300; i++) {
+            sprintf(buf, "key%d", i);
+            ok &= map_set(&om, buf, i);
+        }
+        test_assert(ok && map_freeze(&om));
+        for (i = 0, ok = 1; i < 300; i++) {
+            sprintf(buf, "key%d", i);
+            ok &= map_get(&om, buf) && *om.valref == i;
+        }
+        test_assert(ok && map_get(&om, "key300") == NULL && map_get_slice(&om, "key12345", 5) && *om.valref == 12);
+        iter = map_iter(&om);
+        for (count = 0; map_next(&om, &iter, &key); count++) {
+        }
+        test_assert(count == 300);
+        map_delete(&om);
+
+        /* Plain keys get hashed again, keys only the map's functions understand can't be */
+        map_init(&cm, NULL, constant_hash);
+        map_set(&cm, 1, 'a');
+        map_set(&cm, 2, 'b');
+        test_assert(map_freeze(&cm) && *map_get(&cm, 1) == 'a' && *map_get(&cm, 2) == 'b');
+        map_delete(&cm);
+        map_init(&cm, int_cmp, constant_hash);
+        map_set(&cm, 1, 'a');
+        map_set(&cm, 2, 'b');
+        test_assert(!map_freeze(&cm) && !(cm.base.flags & MAP_FROZEN_) && *map_get(&cm, 2) == 'b');
+        map_delete(&cm);
+    }
+
+    test_section("map_save|map_open_mmap|map_verify") {
+        map_lf_i bm, fm, im;
+        map_t(double, char) cm;
+        map_t(char *, int) om;
+        const char *path = "cmap_test.img";
+        FILE *f;
+        double k;
+        map_iter_t iter;
+        int i, ok, count;
+        map_stdinit(&bm);
+        map_init_flat(&fm, NULL, NULL);
+        map_stdinit(&im);
+        for (i = 0; i < 1000; i++) {
+            map_set(&bm, i * 0.5, i);
+            map_set(&fm, i * 0.5, i);
+        }
+        test_assert(map_save(&bm, path) && !(bm.base.flags & MAP_FROZEN_));
+        map_set(&im, 1.0, 1);
+        test_assert(map_open_mmap(&im, path) && im.base.nnodes == 1000 && map_verify(&im));
+        for (i = 0, ok = 1; i < 1000; i++) {
+            ok &= map_get(&im, i * 0.5) && *im.valref == i && map_get(&im, i * 0.5 + 0.25) == NULL;
+        }
+        test_assert(ok && !map_set(&im, 1e9, 1) && map_equal(&im, &fm, NULL));
+        iter = map_iter(&im);
+        for (count = 0, ok = 1; map_next(&im, &iter, &k); count++) {
+            ok &= *map_get(&im, k) == (int) (k * 2);
+        }
+        test_assert(ok && count == 1000);
+        /* An opened image saves again, a frozen map saves its own storage */
+        test_assert(map_save(&im, path));
+        map_delete(&im);
+        test_assert(map_freeze(&fm) && map_save(&fm, path) && map_open_mmap(&im, path) && map_equal(&im, &fm, NULL));
+        map_delete(&im);
+        test_assert(im.base.nnodes == 0 && map_set(&im, 2.0, 2) && *map_get(&im, 2.0) == 2);
+        map_delete(&im);
+
+        /* Damaged data is caught by map_verify, a damaged header or other types by map_open_mmap */
+        f = fopen(path, "r+b");
+        fseek(f, 200, SEEK_SET);
+        fputc(fgetc(f) ^ 1, f);
+        fclose(f);
+        test_assert(map_open_mmap(&im, path) && !map_verify(&im));
+        map_delete(&im);
+        f = fopen(path, "r+b");
+        fseek(f, 20, SEEK_SET);
+        fputc(fgetc(f) ^ 1, f);
+        fclose(f);
+        test_assert(!map_open_mmap(&im, path) && im.base.nnodes == 0);
+        map_init(&cm, NULL, NULL);
+        test_assert(map_save(&bm, path) && !map_open_mmap(&cm, path) && !map_open_mmap(&im, "missing.img"));
+        map_init_strkeys(&om, NULL);
+        map_set(&om, "a", 1);
+        test_assert(!map_save(&om, path) && !map_verify(&bm));
+        remove(path);
+        map_delete(&om);
+        map_delete(&bm);
+        map_delete(&fm);
+    }
+
+    test_section("map_init_dense|map_iter_remove") {
+        map_t(int, int) dm, em, *dmp = &dm, *emp = &em;
+        map_t(char *, int) sm, *smp = &sm;
+        map_iter_t it;
+        char buf[32], *skey;
+        int k, engine, ordered, count, sum;
+        map_init_dense(dmp, NULL, NULL);
+        for (k = 999; k >= 0; k--) {
+            test_assertmany(k == 0, map_set(dmp, k, k * 2));
+        }
+        test_assert(map_set(dmp, 500, -1) && dm.base.nnodes == 1000);
+        it = map_iter(dmp);
+        for (k = 999, ordered = 1; map_next(dmp, &it, &engine); k--) {
+            /* overwriting keeps the original position */
+            ordered &= (engine == k && *map_get(dmp, engine) == (k == 500 ? -1 : k * 2));
+        }
+        test_assert(ordered && k == -1);
+        for (k = 0; k < 1000; k += 3) {
+            map_remove(dmp, k);
+        }
+        test_assert(map_set(dmp, 0, 0) && dm.base.nnodes == 667);
+        it = map_iter(dmp);
+        for (k = 999, ordered = 1, count = 0; map_next(dmp, &it, &engine); count++) {
+            if (engine == 0) {
+                continue;
+            }
+            while (k % 3 == 0) {
+                k--;
+            }
+            ordered &= (engine == k--);
+        }
+        /* re-adding a removed key puts it last */
+        test_assert(ordered && count == 667 && engine == 0);
+        for (k = 0; k < 1000; k++) {
+            map_remove(dmp, k);
+        }
+        /* mostly dead entries were squeezed out on the way */
+        test_assert(dm.base.nnodes == 0 && dm.base.nentries < 16 && map_get(dmp, 1) == NULL);
+        map_delete(dmp);
+        /* a lowered load factor grows the index instead of cutting the entry array below the entries */
+        map_init_dense(dmp, NULL, NULL);
+        for (k = 0; k < 600; k++) {
+            test_assertmany(k == 599, map_set(dmp, k, k));
+        }
+        map_load_factor(dmp, 0.1f, 0.0f);
+        test_assert(dm.base.entcap > dm.base.nnodes && map_set(dmp, 600, 600));
+        for (k = 0, ordered = 1; k <= 600; k++) {
+            ordered &= map_get(dmp, k) != NULL && *map_get(dmp, k) == k;
+        }
+        test_assert(ordered && dm.base.nnodes == 601);
+        map_delete(dmp);
+
+        /* removing the current key while iterating, on every engine */
+        for (engine = 0; engine < 4; engine++) {
+            init_engine(emp, NULL, NULL, engine);
+            for (k = 0; k < 2000; k++) {
+                test_assertmany(k == 1999, map_set(emp, k, k));
+            }
+            it = map_iter(emp);
+            count = sum = 0;
+            while (map_next(emp, &it, &k)) {
+                sum += k;
+                if (k % 2 == 0) {
+                    count += map_iter_remove(emp, &it);
+                    /* a second removal of the same entry is refused */
+                    count += map_iter_remove(emp, &it) * 10000;
+                }
+            }
+            test_assert(count == 1000 && sum == 1999 * 2000 / 2 && em.base.nnodes == 1000);
+            for (k = 0; k < 2000; k++) {
+                test_assertmany(k == 1999, (map_get(emp, k) != NULL) == (k % 2 == 1));
+            }
+            it = map_iter(emp);
+            while (map_next(emp, &it, &k)) {
+                map_iter_remove(emp, &it);
+            }
+            test_assert(em.base.nnodes == 0 && map_get(emp, 1) == NULL);
+            test_assert(map_set(emp, 1, 1) && *map_get(emp, 1) == 1);
+            map_delete(emp);
+        }
+        it = map_iter(emp);
+        test_assert(!map_iter_remove(emp, &it));
+        /* every key in one chain, removing twice in the middle of it must not take the previous node */
+        map_init(emp, NULL, constant_hash);
+        for (k = 0; k < 5; k++) {
+            test_assertmany(k == 4, map_set(emp, k, k));
+        }
+        it = map_iter(emp);
+        count = 0;
+        while (map_next(emp, &it, &k)) {
+            if (++count == 3) {
+                test_assert(map_iter_remove(emp, &it) && !map_iter_remove(emp, &it));
+            }
+        }
+        test_assert(count == 5 && em.base.nnodes == 4);
+        map_delete(emp);
+
+        map_init_dense_strkeys(smp, NULL);
+        for (k = 0; k < 100; k++) {
+            sprintf(buf, "k%d", k);
+            test_assertmany(k == 99, map_set(smp, buf, k));
+        }
+        it = map_iter(smp);
+        for (k = 0, ordered = 1; map_next(smp, &it, &skey); k++) {
+            sprintf(buf, "k%d", k);
+            ordered &= (strcmp(skey, buf) == 0);
+            if (k < 50) {
+                map_iter_remove(smp, &it);
+            }
+        }
+        test_assert(ordered && sm.base.nnodes == 50 && map_get(smp, "k49") == NULL && *map_get(smp, "k50") == 50);
+        map_delete(smp);
+    }
+
+    test_section("map_stats") {
+        map_t(int, int) sm, *smp = &sm;
+        map_stats_t st;
+        int k, engine;
+        size_t i, total;
+        map_stdinit(smp);
+        map_stats(smp, &st);
+        test_assert(st.nnodes == 0 && st.load_factor == 0 && st.max_probe == 0 && st.node_bytes == 0);
+        for (engine = 0; engine < 4; engine++) {
+            /* the last round freezes a chained map */
+            init_engine(smp, int_cmp, constant_hash, engine % 3);
+            for (k = 0; k < 40; k++) {
+                test_assertmany(k == 39, map_set(smp, k, k));
+            }
+            if (engine == 3) {
+                /* all keys collide, so freezing fails; spread them first */
+                map_delete(smp);
+                map_stdinit(smp);
+                for (k = 0; k < 40; k++) {
+                    map_set(smp, k, k);
+                }
+                test_assert(map_freeze(smp));
+            }
+            test_assert(map_get(smp, 1) != NULL && map_get(smp, 100) == NULL);
+            map_stats(smp, &st);
+            for (i = total = 0; i < MAP_STATS_NPROBES; i++) {
+                total += st.probes[i];
+            }
+            test_assert(st.nnodes == 40 && total == 40 && st.bucket_bytes > 0 && st.node_bytes >= 40 * 2 * sizeof(int));
+            test_assert(st.load_factor > 0 && st.avg_probe >= 1 && st.avg_probe <= st.max_probe);
+            if (engine == 0) {
+                /* one chain holding everything */
+                test_assert(st.max_probe == 40 && st.probes[0] == 1 && st.probes[MAP_STATS_NPROBES - 1] == 40 - MAP_STATS_NPROBES + 1);
+            } else if (engine == 3) {
+                test_assert(st.max_probe == 1 && st.probes[0] == 40);
+            } else {
+                test_assert(st.max_probe > 1);
+            }
+            if (st.counting) {
+                test_assert(st.counters.hits >= 1 && st.counters.misses >= 41 && st.lookups == st.counters.hits + st.counters.misses);
+                test_assert(engine == 3 || (st.counters.comparisons >= 40 * 39 / 2 && st.counters.resizes > 0));
+            } else {
+                test_assert(st.lookups == 0 && st.counters.comparisons == 0 && st.counters.resizes == 0);
+            }
+            map_delete(smp);
+        }
+        /* an entry is tallied once while an incremental resize is halfway */
+        map_init_incremental(smp, NULL, NULL);
+        for (k = 0; sm.base.oldbuckets == NULL || sm.base.migrated == 0; k++) {
+            test_assertmany(0, map_set(smp, k, k));
+        }
+        map_stats(smp, &st);
+        for (i = total = 0; i < MAP_STATS_NPROBES; i++) {
+            total += st.probes[i];
+        }
+        test_assert(sm.base.oldbuckets != NULL && total == sm.base.nnodes && st.avg_probe <= st.max_probe);
+        map_delete(smp);
+    }
+
+    test_section("map_from_pairs_parallel|map_copy_parallel") {
+        map_t(int, int) seq, par, cp, *seqp = &seq, *parp = &par, *cpp = &cp;
+        map_pair_t(int, int) *pairs = malloc(100000 * sizeof(*pairs));
+        map_allocator_t alloc;
+        size_t live = 0;
+        int i, engine;
+        test_assert(pairs != NULL);
+        for (i = 0; i < 100000; i++) {
+            /* every key twice or more, the last value wins */
+            pairs[i].k = (i * 7919) % 60000;
+            pairs[i].v = i;
+        }
+        alloc.alloc = count_alloc;
+        alloc.realloc = count_realloc;
+        alloc.free = count_free;
+        alloc.udata = &live;
+        map_stdinit(seqp);
+        test_assert(map_from_pairs(seqp, 100000, pairs) && seq.base.nnodes == 60000);
+        for (engine = 0; engine < 4; engine++) {
+            if (engine == 2) {
+                map_init_pool(parp, NULL, NULL, &alloc);
+            } else {
+                init_engine(parp, NULL, NULL, engine);
+            }
+            /* existing keys are overwritten too */
+            test_assert(map_set(parp, 5, -1) && map_set(parp, -5, -1));
+            test_assert(map_from_pairs_parallel(parp, 100000, pairs, 4));
+            test_assert(par.base.nnodes == 60001 && *map_get(parp, -5) == -1 && *map_get(parp, 5) == *map_get(seqp, 5));
+            map_remove(parp, -5);
+            test_assert(map_equal(parp, seqp, NULL));
+            init_engine(cpp, NULL, NULL, (engine == 1) ? 0 : 1);
+            test_assert(map_copy_parallel(cpp, parp, 0) && map_equal(cpp, seqp, NULL));
+            map_delete(cpp);
+            map_delete(parp);
+        }
+        test_assert(live == 0);
+        {
+            map_t(char *, int) sk, *skp = &sk;
+            map_pair_t(char *, int) *spairs = malloc(20000 * sizeof(*spairs));
+            char *strs = malloc(20000 * 8);
+            test_assert(spairs != NULL && strs != NULL);
+            for (i = 0; i < 20000; i++) {
+                sprintf(strs + i * 8, "s%d", i % 15000);
+                spairs[i].k = strs + i * 8;
+                spairs[i].v = i;
+            }
+            map_init_strkeys(skp, NULL);
+            test_assert(map_from_pairs_parallel(skp, 20000, spairs, 4) && sk.base.nnodes == 15000);
+            memset(strs, 'x', 20000 * 8 - 1); /* keys were copied */
+            test_assert(*map_get(skp, "s0") == 15000 && *map_get(skp, "s14999") == 14999);
+            map_delete(skp);
+            free(strs);
+            free(spairs);
+        }
+        /* copying a map into itself or from an empty map changes nothing */
+        for (engine = 0; engine < 3; engine++) {
+            init_engine(parp, NULL, NULL, engine);
+            test_assert(map_copy_parallel(parp, parp, 4) && par.base.nnodes == 0);
+            test_assert(map_from_pairs_parallel(parp, 100000, pairs, 4) && map_copy_parallel(parp, parp, 4));
+            test_assert(par.base.nnodes == 60000 && map_equal(parp, seqp, NULL));
+            map_stdinit(cpp);
+            test_assert(map_copy_parallel(parp, cpp, 4) && map_equal(parp, seqp, NULL));
+            map_delete(cpp);
+            map_delete(parp);
+        }
+        map_stdinit(parp);
+        test_assert(map_from_pairs_parallel(parp, 10, pairs, 8) && par.base.nnodes == 10);
+        test_assert(map_from_pairs_parallel(parp, 0, pairs, 8) && par.base.nnodes == 10);
+        map_delete(parp);
+        map_delete(seqp);
+        free(pairs);
+    }
+
+    test_section("map_copy|map_equal clone") {
+        map_t(int, int) src, dst, other, *srcp = &src, *dstp = &dst, *otherp = &other;
+        map_t(char *, int) ssrc, sdst, *ssrcp = &ssrc, *sdstp = &sdst;
+        map_iter_t it, it2;
+        char buf[16], *skey;
+        int k, k2, engine, same;
+        for (engine = 0; engine < 4; engine++) {
+            if (engine == 3) {
+                map_init_pool(srcp, NULL, NULL, NULL);
+                map_init_pool(dstp, NULL, NULL, NULL);
+            } else {
+                init_engine(srcp, NULL, NULL, engine);
+                init_engine(dstp, NULL, NULL, engine);
+            }
+            for (k = 0; k < 3000; k++) {
+                test_assertmany(k == 2999, map_set(srcp, k, -k));
+            }
+            for (k = 0; k < 3000; k += 3) {
+                map_remove(srcp, k);
+            }
+            test_assert(map_copy(dstp, srcp) && dst.base.nnodes == 2000 && dst.base.nbuckets == src.base.nbuckets);
+            test_assert(map_equal(dstp, srcp, NULL) && map_equal(srcp, dstp, NULL));
+            /* same layout, so the same iteration order */
+            it = map_iter(srcp);
+            it2 = map_iter(dstp);
+            for (same = 1; map_next(srcp, &it, &k);) {
+                same &= map_next(dstp, &it2, &k2) && k == k2;
+            }
+            test_assert(same && !map_next(dstp, &it2, &k2));
+            /* the copy is independent */
+            test_assert(map_set(dstp, 1, 7) && *map_get(srcp, 1) == -1 && !map_equal(dstp, srcp, NULL));
+            test_assert(map_set(dstp, 3, 3) && map_get(srcp, 3) == NULL && dst.base.nnodes == 2001);
+            map_delete(srcp);
+            test_assert(*map_get(dstp, 2999) == -2999);
+            /* different hash functions still compare, copying into a non-empty map merges */
+            map_init(otherp, NULL, constant_hash);
+            test_assert(map_set(otherp, 100000, 0) && map_copy(otherp, dstp) && other.base.nnodes == 2002);
+            map_remove(otherp, 100000);
+            test_assert(map_equal(otherp, dstp, NULL) && map_equal(dstp, otherp, NULL));
+            map_delete(otherp);
+            map_delete(dstp);
+        }
+        /* a frozen source has nnodes slots, the copy gets a power of two buckets for its entries */
+        map_stdinit(srcp);
+        for (k = 0; k < 1000; k++) {
+            test_assertmany(k == 999, map_set(srcp, k, -k));
+        }
+        test_assert(map_freeze(srcp) && src.base.nbuckets == 1000);
+        for (engine = 0; engine < 3; engine++) {
+            init_engine(dstp, NULL, NULL, engine);
+            test_assert(map_copy(dstp, srcp) && map_equal(dstp, srcp, NULL));
+            test_assert((dst.base.nbuckets & (dst.base.nbuckets - 1)) == 0 && dst.base.nbuckets >= 1024);
+            map_delete(dstp);
+        }
+        /* nor does copying shrink a destination holding more */
+        map_stdinit(dstp);
+        for (k = 0; k < 20000; k++) {
+            test_assertmany(k == 19999, map_set(dstp, -k - 1, k));
+        }
+        k2 = (int) dst.base.nbuckets;
+        test_assert(map_copy(dstp, srcp) && dst.base.nnodes == 21000 && dst.base.nbuckets >= (size_t) k2);
+        test_assert(*map_get(dstp, 999) == -999 && *map_get(dstp, -20000) == 19999);
+        map_delete(dstp);
+        map_delete(srcp);
+        for (engine = 0; engine < 3; engine++) {
+            if (engine == 1) {
+                map_init_flat_strkeys(ssrcp, NULL);
+                map_init_flat_strkeys(sdstp, NULL);
+            } else if (engine == 2) {
+                map_init_dense_strkeys(ssrcp, NULL);
+                map_init_dense_strkeys(sdstp, NULL);
+            } else {
+                map_init_strkeys(ssrcp, NULL);
+                map_init_strkeys(sdstp, NULL);
+            }
+            for (k = 0; k < 200; k++) {
+                sprintf(buf, "key%d", k);
+                test_assertmany(k == 199, map_set(ssrcp, buf, k));
+            }
+            map_remove(ssrcp, "key5");
+            test_assert(map_copy(sdstp, ssrcp) && map_equal(sdstp, ssrcp, NULL));
+            map_delete(ssrcp);
+            it = map_iter(sdstp);
+            for (same = 1; map_next(sdstp, &it, &skey);) {
+                same &= *map_get(sdstp, skey) == atoi(skey + 3);
+            }
+            test_assert(same && sdst.base.nnodes == 199 && map_get(sdstp, "key5") == NULL);
+            map_delete(sdstp);
+        }
+    }
+
+    test_section("map_merge|map_merge_move|map_intersect|map_difference") {
+        map_t(int, int) a, b, *ap = &a, *bp = &b;
+        map_t(char *, int) sa, sb, *sap = &sa, *sbp = &sb;
+        char buf[16];
+        size_t live = 0;
+        map_allocator_t alloc;
+        MapHashFunction bhash;
+        int k, engine, move, ok;
+        alloc.alloc = count_alloc;
+        alloc.realloc = count_realloc;
+        alloc.free = count_free;
+        alloc.udata = &live;
+        /* a holds 0..999, b holds 500..1999: chained, flat, dense, then b hashing differently */
+        for (engine = 0; engine < 4; engine++) {
+            bhash = (engine == 3) ? constant_hash : map_generic_hash;
+            for (move = 0; move < 2; move++) {
+                init_engine(ap, NULL, NULL, engine % 3);
+                init_engine(bp, NULL, bhash, engine % 3);
+                map_use_allocator(ap, &alloc);
+                map_use_allocator(bp, &alloc);
+                for (k = 0; k < 2000; k++) {
+                    test_assertmany(k == 1999, (k >= 1000 || map_set(ap, k, k)) && (k < 500 || map_set(bp, k, 1)));
+                }
+                test_assert(move ? map_merge_move(ap, bp, int_add) : map_merge(ap, bp, int_add));
+                for (k = 0, ok = 1; k < 2000; k++) {
+                    ok &= map_get(ap, k) != NULL && *map_get(ap, k) == (k < 500 ? k : k < 1000 ? k + 1 : 1);
+                }
+                test_assert(ok && a.base.nnodes == 2000);
+                test_assert(move ? (b.base.nnodes == 0 && map_get(bp, 600) == NULL) : b.base.nnodes == 1500);
+                map_delete(ap);
+                map_delete(bp);
+                test_assert(live == 0);
+            }
+            init_engine(ap, NULL, NULL, engine % 3);
+            map_init(bp, NULL, bhash);
+            for (k = 0; k < 2000; k++) {
+                test_assertmany(k == 1999, (k >= 1000 || map_set(ap, k, k)) && (k < 500 || map_set(bp, k, 1)));
+            }
+            test_assert(map_intersect(ap, bp) && a.base.nnodes == 500);
+            for (k = 0, ok = 1; k < 2000; k++) {
+                ok &= (map_get(ap, k) != NULL) == (k >= 500 && k < 1000);
+            }
+            test_assert(ok && b.base.nnodes == 1500);
+            test_assert(map_set(ap, 0, 0) && map_set(ap, 1, 1) && map_difference(ap, bp) && a.base.nnodes == 2);
+            test_assert(map_get(ap, 0) && map_get(ap, 1) && !map_get(ap, 700));
+            /* the other direction walks the smaller map */
+            test_assert(map_difference(bp, ap) && b.base.nnodes == 1500);
+            test_assert(map_set(ap, 1500, 0) && map_difference(bp, ap) && b.base.nnodes == 1499 && !map_get(bp, 1500));
+            test_assert(map_difference(ap, ap) && a.base.nnodes == 0 && !map_merge(bp, bp, NULL));
+            map_delete(ap);
+            map_delete(bp);
+        }
+        /* owned string keys move or get copied along */
+        for (move = 0; move < 2; move++) {
+            map_init_strkeys(sap, NULL);
+            map_init_strkeys(sbp, NULL);
+            for (k = 0; k < 100; k++) {
+                sprintf(buf, "k%d", k);
+                test_assertmany(k == 99, map_set(k < 50 ? sap : sbp, buf, k) && map_set(sbp, buf, k));
+            }
+            test_assert(move ? map_merge_move(sap, sbp, NULL) : map_merge(sap, sbp, int_add));
+            test_assert(sa.base.nnodes == 100 && *map_get(sap, "k10") == (move ? 10 : 20) && *map_get(sap, "k90") == 90);
+            map_delete(sbp);
+            test_assert(*map_get(sap, "k99") == 99);
+            map_delete(sap);
+        }
+    }
+
+    test_section("MAP_DECLARE") {
+        imap_t im, copy, *imp = &im;
+        int k, engine, ok;
+        for (engine = 0; engine < 3; engine++) {
+            if (engine == 0) {
+                imap_init(imp);
+            } else {
+                init_engine(imp, imap_cmp_cb, imap_hash_cb, (engine == 1) ? 1 : 3);
+            }
+            test_assert(imap_get(imp, 1) == NULL);
+            for (k = 0, ok = 1; k < 5000; k++) {
+                ok &= (k % 2) ? imap_set(imp, k, k * 10L) : map_set(imp, k, k * 10L);
+            }
+            test_assert(ok && im.base.nnodes == 5000);
+            /* both paths see the entries of the other */
+            for (k = 0, ok = 1; k < 5000; k++) {
+                ok &= imap_get(imp, k) != NULL && *imap_get(imp, k) == k * 10L && map_get(imp, k) == imap_get(imp, k);
+            }
+            test_assert(ok && imap_get(imp, 5000) == NULL && imap_get(imp, -1) == NULL);
+            test_assert(imap_set(imp, 7, -7) && *map_get(imp, 7) == -7 && im.base.nnodes == 5000);
+            imap_remove(imp, 7);
+            map_remove(imp, 8);
+            test_assert(imap_get(imp, 7) == NULL && imap_get(imp, 8) == NULL && im.base.nnodes == 4998);
+            imap_init(&copy);
+            test_assert(map_copy(&copy, imp) && map_equal(&copy, imp, NULL) && *imap_get(&copy, 4999) == 49990L);
+            map_delete(&copy);
+            map_delete(imp);
+            test_assert(imap_get(imp, 1) == NULL);
+        }
+        /* one hash per call on every engine, whether inserting, overwriting or removing */
+        for (engine = 0; engine < 4; engine++) {
+            countmap_t cm;
+            init_engine(&cm, countmap_cmp_cb, countmap_hash_cb, engine);
+            nhashed = 0;
+            for (k = 0, ok = 1; k < 3000; k++) {
+                ok &= countmap_set(&cm, k, k) && countmap_set(&cm, k, k + 1L);
+            }
+            for (k = 0; k < 3000; k += 2) {
+                countmap_remove(&cm, k);
+            }
+            test_assert(ok && nhashed == 7500 && cm.base.nnodes == 1500);
+            for (k = 0, ok = 1; k < 3000; k++) {
+                ok &= (k % 2) ? *countmap_get(&cm, k) == k + 1L : countmap_get(&cm, k) == NULL;
+            }
+            test_assert(ok);
+            map_delete(&cm);
+        }
+        /* seeded maps store other hashes, the generic path takes over */
+        map_init_seeded(imp, imap_cmp_cb, map_fast_hash_seeded, 7);
+        for (k = 0, ok = 1; k < 1000; k++) {
+            ok &= imap_set(imp, k, k) && imap_set(imp, k, -k);
+        }
+        imap_remove(imp, 5);
+        test_assert(ok && im.base.nnodes == 999 && *imap_get(imp, 9) == -9 && *map_get(imp, 9) == -9 && imap_get(imp, 5) == NULL);
+        map_delete(imp);
+    }
+
+    test_section("map_init_int|map_int_hash") {
+        map_t(int, int) im, *imp = &im;
+        map_t(size_t, int) zm;
+        map_t(void *, int) pm;
+        map_t(short, int) hm;
+        map_t(char, int) cm;
+        map_iter_t it;
+        size_t hashes[256], z;
+        unsigned char seen[256];
+        static char bytes[1000];
+        int k, engine, ok, spread;
+        map_stats_t st;
+        /* picked by default for 4 and 8 byte keys compared bytewise, never with callbacks or a seed */
+        map_stdinit(&zm);
+        map_stdinit(&pm);
+        map_stdinit(&cm);
+        test_assert((zm.base.flags & MAP_INTKEYS_) && pm.base.hash_func == map_int_hash);
+        test_assert(!(cm.base.flags & MAP_INTKEYS_) && cm.base.hash_func == map_generic_hash);
+        map_init(imp, int_cmp, NULL);
+        test_assert(!(im.base.flags & MAP_INTKEYS_) && im.base.hash_func == map_generic_hash);
+        map_init_seeded(imp, NULL, map_fast_hash_seeded, 42);
+        test_assert(!(im.base.flags & MAP_INTKEYS_) && im.base.hash_func == NULL);
+        map_init_int(&hm);
+        test_assert((hm.base.flags & MAP_INTKEYS_) && hm.base.cmp_func == map_generic_cmp);
+
+        /* equal hashes only for equal keys, and strided keys still spread over the low bits */
+        memset(seen, 0, sizeof(seen));
+        for (z = 0, ok = 1, spread = 0; z < 256; z++) {
+            hashes[z] = map_int_hash(&z, sizeof(z));
+            z <<= 12;
+            spread += !seen[map_int_hash(&z, sizeof(z)) & 255];
+            seen[map_int_hash(&z, sizeof(z)) & 255] = 1;
+            z >>= 12;
+        }
+        for (z = 1; z < 256; z++) {
+            ok &= hashes[z] != hashes[z - 1];
+        }
+        test_assert(ok && spread > 128 && chain_cost(hashes, 256) < 2.0);
+
+        for (engine = 0; engine < 4; engine++) {
+            /* int keys take the same mode on their own */
+            init_engine(imp, NULL, NULL, engine);
+            for (k = -5000, ok = 1; k < 5000; k++) {
+                ok &= map_set(imp, k, k * 2);
+            }
+            test_assert(ok && im.base.nnodes == 10000);
+            for (k = -5000, ok = 1; k < 5000; k += 2) {
+                map_remove(imp, k);
+            }
+            for (k = -5000, ok = 1; k < 5000; k++) {
+                ok &= (k % 2 == 0) ? map_get(imp, k) == NULL : *map_get(imp, k) == k * 2;
+            }
+            map_stats(imp, &st);
+            /* hits are decided by the hash alone */
+            test_assert(ok && im.base.nnodes == 5000 && map_get(imp, 5000) == NULL && st.counters.comparisons == 0);
+            map_delete(imp);
+        }
+
+        for (k = 0, ok = 1; k < 1000; k++) {
+            ok &= map_set(&zm, (size_t) k * 65536, k) && map_set(&pm, bytes + k, k)
+                && map_set(&hm, (short) -k, k);
+        }
+        for (k = 0; k < 1000; k++) {
+            ok &= *map_get(&zm, (size_t) k * 65536) == k && map_get(&pm, bytes + k) != NULL
+                && *map_get(&hm, (short) -k) == k;
+        }
+        test_assert(ok && zm.base.nnodes == 1000 && hm.base.nnodes == 1000 && map_get(&hm, 1) == NULL);
+        test_assert(map_freeze(&zm) && *map_get(&zm, (size_t) 999 * 65536) == 999 && map_get(&zm, 1) == NULL);
+
+        /* removing while iterating keeps working on long chains */
+        map_init(imp, NULL, constant_hash);
+        for (k = 0; k < 100; k++) {
+            test_assertmany(k == 99, map_set(imp, k, k));
+        }
+        it = map_iter(imp);
+        for (ok = 0; map_next(imp, &it, &k);) {
+            ok += (k % 3 == 0) && map_iter_remove(imp, &it) && !map_iter_remove(imp, &it);
+        }
+        test_assert(ok == 34 && im.base.nnodes == 66 && map_get(imp, 3) == NULL && *map_get(imp, 4) == 4);
+        map_delete(imp);
+        map_delete(&zm);
+        map_delete(&pm);
+        map_delete(&hm);
+        map_delete(&cm);
+    }
+
+    test_section("map_init_cache|map_on_evict|map_counters") {
+        map_t(int, int) cm, big, *cmp = &cm;
+        map_t(int, char *) pm;
+        map_iter_t it;
+        size_t evicted[2] = {0, 0}, live = 0;
+        char **buf;
+        int k, ok;
+        map_init_cache(cmp, NULL, NULL, 100);
+        map_on_evict(cmp, count_evicted, evicted);
+        for (k = 0, ok = 1; k < 100; k++) {
+            ok &= map_set(cmp, k, k);
+        }
+        for (k = 0; k < 50; k++) {
+            ok &= map_get(cmp, k) != NULL;
+        }
+        test_assert(ok && map_counters(cmp).hits == 50 && map_counters(cmp).misses == 100);
+        /* the entries looked up since being added survive, the others go first in insertion order */
+        for (k = 100; k < 150; k++) {
+            ok &= map_set(cmp, k, k) && cm.base.nnodes == 100;
+        }
+        test_assert(ok && map_counters(cmp).evictions == 50 && evicted[0] == 50 && evicted[1] == (50 + 99) * 50 / 2);
+        for (k = 0; k < 150; k++) {
+            ok &= (map_get(cmp, k) != NULL) == (k < 50 || k >= 100);
+        }
+        test_assert(ok && map_set(cmp, 7, -7) && map_counters(cmp).evictions == 50);
+        /* a long stream keeps both the entry count and the arrays bounded */
+        for (k = 1000; k < 100000; k++) {
+            ok &= map_set(cmp, k, k) && cm.base.nnodes <= 100 && map_get(cmp, k) != NULL;
+        }
+        test_assert(ok && cm.base.nnodes == 100 && cm.base.nbuckets <= 512 && cm.base.entcap <= 384);
+        test_assert(map_get(cmp, 99999) != NULL && map_counters(cmp).evictions == 99000 + 50 && evicted[0] == 99050);
+        map_stdinit(&big);
+        for (k = 0; k < 1000; k++) {
+            ok &= map_set(&big, k, k);
+        }
+        map_delete(cmp);
+        test_assert(ok && map_copy(cmp, &big) && cm.base.nnodes == 100 && map_counters(cmp).evictions == 99050 + 900);
+        map_delete(&big);
+        map_delete(cmp);
+
+        /* values owning memory are released as they're evicted */
+        map_init_cache(&pm, NULL, NULL, 10);
+        map_on_evict(&pm, free_evicted, &live);
+        for (k = 0, ok = 1; k < 1000; k++) {
+            buf = map_get_or_insert(&pm, k, NULL, NULL);
+            ok &= buf != NULL && (*buf = (char *) count_alloc(&live, 16)) != NULL;
+        }
+        test_assert(ok && live == 10);
+        it = map_iter(&pm);
+        while (map_next(&pm, &it, &k)) {
+            count_free(&live, *map_get(&pm, k));
+        }
+        test_assert(live == 0);
+        map_delete(&pm);
+    }
+
+    test_section("map_small_t|map_init_small") {
+        map_small_t(int, int, 4) sm, other;
+        map_small_t(char, double, 3) cm;
+        map_t(int, int) big;
+        map_allocator_t alloc;
+        map_iter_t it;
+        map_stats_t st;
+        size_t live = 0;
+        int k, ok, ordered;
+        char c;
+        alloc.alloc = count_alloc;
+        alloc.realloc = count_realloc;
+        alloc.free = count_free;
+        alloc.udata = &live;
+        map_init_small(&sm, NULL, NULL);
+        map_use_allocator(&sm, &alloc);
+        for (k = 0, ok = 1; k < 4; k++) {
+            ok &= map_set(&sm, k, k * 10) && map_set(&sm, k, k);
+        }
+        map_remove(&sm, 1);
+        /* the dead entry is reused instead of spilling */
+        ok &= map_set(&sm, 4, 4) && map_get(&sm, 1) == NULL && *map_get(&sm, 4) == 4;
+        map_stats(&sm, &st);
+        test_assert(ok && live == 0 && sm.base.nnodes == 4 && sm.base.nbuckets == 0 && st.node_bytes == 0);
+        /* inline maps are values */
+        other = sm;
+        test_assert(map_set(&other, 0, -1) && *map_get(&sm, 0) == 0 && *map_get(&other, 0) == -1);
+        map_remove(&other, 2);
+        test_assert(map_get(&sm, 2) != NULL && other.base.nnodes == 3 && live == 0);
+
+        for (k = 5; k < 100; k++) {
+            ok &= map_set(&sm, k, k);
+        }
+        test_assert(ok && live == 2 && sm.base.nnodes == 99 && sm.base.nbuckets > 0);
+        it = map_iter(&sm);
+        for (ok = 1, ordered = -1; map_next(&sm, &it, &k); ordered = k) {
+            /* 0, 2, 3, then 4 in the slot 1 was in, and the rest in order */
+            ok &= (ordered == -1) ? k == 0 : (ordered == 0) ? k == 2 : (k == ordered + 1) && *map_get(&sm, k) == k;
+        }
+        test_assert(ok && ordered == 99 && map_get(&sm, 1) == NULL);
+        map_delete(&sm);
+        test_assert(live == 0 && map_set(&sm, 7, 7) && *map_get(&sm, 7) == 7 && live == 0);
+        map_delete(&sm);
+
+        map_stdinit(&big);
+        for (k = 0; k < 3; k++) {
+            ok &= map_set(&big, k, k);
+        }
+        test_assert(ok && map_copy(&sm, &big) && live == 0 && map_equal(&sm, &big, NULL));
+        test_assert(map_reserve(&sm, 4) && live == 0 && map_reserve(&sm, 100) && live == 2 && map_equal(&sm, &big, NULL));
+        map_delete(&sm);
+        map_delete(&big);
+
+        map_init_small(&cm, NULL, NULL);
+        for (c = 'a', ok = 1; c <= 'z'; c++) {
+            ok &= map_set(&cm, c, c / 2.0);
+        }
+        for (c = 'a'; c <= 'z'; c++) {
+            ok &= *map_get(&cm, c) == c / 2.0;
+        }
+        test_assert(ok && cm.base.nnodes == 26 && map_freeze(&cm) && *map_get(&cm, 'q') == 'q' / 2.0);
+        map_delete(&cm);
+
+        /* slices of a copy find the copy's own entries */
+        {
+            map_small_t(const char *, int, 4) ss, scopy;
+            map_init_small(&ss, map_string_cmp, map_fast_string_hash);
+            test_assert(map_set(&ss, "alpha", 1) && map_set(&ss, "beta", 2));
+            scopy = ss;
+            map_remove(&ss, "alpha");
+            test_assert(map_get_slice(&scopy, "alphabet", 5) != NULL && *map_get_slice(&scopy, "alphabet", 5) == 1);
+            test_assert((char *) map_get_slice(&scopy, "alphabet", 5) > (char *) &scopy);
+            test_assert((char *) map_get_slice(&scopy, "alphabet", 5) < (char *) (&scopy + 1));
+            scopy = ss;
+            map_set(&ss, "beta", 20);
+            map_remove_slice(&scopy, "beta+", 4);
+            test_assert(map_get(&scopy, "beta") == NULL && scopy.base.nnodes == 0 && *map_get(&ss, "beta") == 20);
+            /* only maps owning their keys can take slices as new keys */
+            scopy = ss;
+            test_assert(!map_set_slice(&scopy, "gamma!", 5, 3) && map_get(&scopy, "gamma") == NULL);
+            map_delete(&scopy);
+            map_delete(&ss);
+        }
+    }
+
+    test_section("set_t|set_add|set_contains|set_remove|set_next") {
+        set_t(int) s;
+        set_t(const char *) ss;
+        set_t(size_t) zs;
+        map_iter_t it;
+        map_stats_t st;
+        const char *str;
+        size_t z;
+        int k, ok, odd, n;
+        set_stdinit(&s);
+        for (k = 0, ok = 1; k < 10000; k++) {
+            ok &= set_add(&s, k) && set_add(&s, k / 2);
+        }
+        test_assert(ok && set_count(&s) == 10000 && set_contains(&s, 9999) && !set_contains(&s, 10000));
+        for (k = 0; k < 10000; k += 2) {
+            set_remove(&s, k);
+        }
+        it = set_iter(&s);
+        for (n = 0, odd = 1; set_next(&s, &it, &k); n++) {
+            odd &= k % 2 == 1 && set_contains(&s, k);
+        }
+        test_assert(odd && n == 5000 && set_count(&s) == 5000 && !set_contains(&s, 0));
+        /* slots hold the key only */
+        map_stats(&s, &st);
+        test_assert(s.base.slotsize == sizeof(int) && st.node_bytes == s.base.nbuckets * sizeof(int));
+        test_assert(map_freeze(&s) && set_contains(&s, 4999) && !set_contains(&s, 4998) && !set_add(&s, 1));
+        set_delete(&s);
+        test_assert(set_count(&s) == 0 && !set_contains(&s, 1) && set_add(&s, 1) && set_contains(&s, 1));
+        set_delete(&s);
+
+        set_init(&ss, map_string_cmp, map_string_hash);
+        test_assert(set_add(&ss, "a") && set_add(&ss, "b") && set_add(&ss, "a") && set_count(&ss) == 2);
+        str = "b";
+        test_assert(set_contains(&ss, str) && !set_contains(&ss, "c"));
+        set_remove(&ss, "a");
+        it = set_iter(&ss);
+        test_assert(set_next(&ss, &it, &str) && strcmp(str, "b") == 0 && !set_next(&ss, &it, &str));
+        set_delete(&ss);
+
+        set_stdinit(&zs);
+        test_assert(map_reserve(&zs, 1000) && (zs.base.flags & MAP_INTKEYS_));
+        for (z = 0, ok = 1; z < 1000; z++) {
+            ok &= set_add(&zs, z * 4096);
+        }
+        for (z = 0; z < 1000; z++) {
+            ok &= set_contains(&zs, z * 4096) && !set_contains(&zs, z * 4096 + 1);
+        }
+        test_assert(ok && set_count(&zs) == 1000);
+        set_delete(&zs);
+    }
+
+    test_section("map_iter_range|map_parallel_for_each|map_parallel_reduce") {
+        map_t(int, int) m;
+        map_small_t(int, int, 4) sm;
+        map_iter_t it;
+        int_sums_t sums, zero;
+        size_t span, n, begin, nthreads;
+        long keys;
+        int k, engine, ok;
+        memset(&zero, 0, sizeof(zero));
+        for (engine = 0; engine < 5; engine++) {
+            /* the last round freezes a chained map */
+            init_engine(&m, NULL, NULL, engine % 4);
+            for (k = 0, ok = 1; k < 50000; k++) {
+                ok &= map_set(&m, k, k);
+            }
+            for (k = 0; k < 50000; k += 5) {
+                map_remove(&m, k);
+            }
+            test_assert(ok && (engine < 4 || map_freeze(&m)));
+            /* three ranges cover every entry once */
+            span = map_iter_span(&m);
+            for (begin = n = 0, keys = 0; begin < span; begin += span / 3 + 1) {
+                it = map_iter_range(&m, begin, begin + span / 3 + 1);
+                while (map_next(&m, &it, &k)) {
+                    n++;
+                    keys += k;
+                }
+            }
+            test_assert(n == 40000 && keys == 1000000000L);
+            /* the starting value counts once, however many threads there are */
+            for (nthreads = 1, ok = 1; nthreads <= 8; nthreads *= 2) {
+                sums.n = 3;
+                sums.keys = 100;
+                sums.vals = -100;
+                map_parallel_reduce(&m, sum_visit, sum_merge, &sums, &zero, nthreads);
+                ok &= sums.n == 40003 && sums.keys == 1000000100L && sums.vals == 999999900L;
+            }
+            test_assert(ok);
+            map_parallel_for_each(&m, double_visit, NULL, 0);
+            for (k = 0, ok = 1; k < 50000; k++) {
+                ok &= (k % 5 == 0) ? map_get(&m, k) == NULL : *map_get(&m, k) == k * 2;
+            }
+            test_assert(ok);
+            map_delete(&m);
+        }
+        /* removing through a range only touches that range */
+        map_stdinit(&m);
+        for (k = 0, ok = 1; k < 1000; k++) {
+            ok &= map_set(&m, k, k);
+        }
+        span = map_iter_span(&m);
+        it = map_iter_range(&m, 0, span / 2);
+        while (map_next(&m, &it, &k)) {
+            map_iter_remove(&m, &it);
+        }
+        test_assert(ok && m.base.nnodes > 0 && m.base.nnodes < 1000);
+        sums = zero;
+        map_parallel_reduce(&m, sum_visit, sum_merge, &sums, &zero, 2);
+        test_assert(sums.n == m.base.nnodes && sums.keys == sums.vals);
+        map_delete(&m);
+        /* small maps and empty maps */
+        map_init_small(&sm, NULL, NULL);
+        test_assert(map_set(&sm, 1, 10) && map_set(&sm, 2, 20));
+        sums = zero;
+        map_parallel_reduce(&sm, sum_visit, sum_merge, &sums, &zero, 8);
+        test_assert(sums.n == 2 && sums.keys == 3 && sums.vals == 30);
+        map_delete(&sm);
+        sums = zero;
+        map_parallel_reduce(&sm, sum_visit, sum_merge, &sums, &zero, 0);
+        test_assert(sums.n == 0 && map_iter_span(&sm) == 0);
+    }
+
     map_delete(mp);
     map_delete(msp);
     test_print_res();
@@ -0,0 +1,46 @@
+#ifndef CMAP_TEST_H
+#define CMAP_TEST_H
+
+#include <stdio.h> /* printf */
+
+#define test_section(desc)        \
+    {                             \
+        printf("--- %s\n", desc); \
+    }
+
+#define test_assermany_(last, cond, condstr)                                      \
+    {                                                                             \
+        static int failed_once__ = 0;                                             \
+        int pass__ = cond;                                                        \
+        if (!failed_once__ && (!pass__ || last)) {                                \
+            printf("[%s] %s:%d: ", pass__ ? "PASS" : "FAIL", __FILE__, __LINE__); \
+            printf((sizeof(condstr) > 50 ? "%.100s...\n" : "%s\n"), condstr);     \
+            if (pass__) {                                                         \
+                pass_count++;                                                     \
+            } else {                                                              \
+                fail_count++;                                                     \
+                failed_once__ = 1;                                                \
+            }                                                                     \
+        }                                                                         \
+    }                                                                             \
+    (void) 0
+
+#define test_assert(cond) \
+    test_assermany_(1, cond, #cond)
+
+#define test_assertmany(last, cond) \
+    test_assermany_(last, cond, #cond)
+
+#define test_print_res()                                                          \
+    {                                                                             \
+        printf("------------------------------------------------------------\n"); \
+        printf("-- Results:   %3d Total    %3d Passed    %3d Failed       --\n",  \
+               pass_count + fail_count, pass_count, fail_count);                  \
+        printf("------------------------------------------------------------\n"); \
+    }                                                                             \
+    (void) 0
+
+static int pass_count = 0;
+static int fail_count = 0;
+
+#endif /* CMAP_TEST_H */
@@ -0,0 +1,119 @@
+#include <cmap_conc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "test.h"
+
+#define NTHREADS 8
+#define NKEYS 20000
+#define NROUNDS 20
+
+typedef map_conc_t(unsigned, unsigned) map_conc_u_u;
+
+typedef struct {
+    map_conc_u_u *m;
+    unsigned id;
+    /* torn or foreign values seen by readers, failed sets by writers */
+    unsigned long errors;
+    unsigned long found;
+} worker_t;
+
+/* Values always encode their key, a reader seeing anything else read a broken node */
+#define VALUE(key, round) ((key) + (unsigned) (round) * NKEYS * 4u)
+
+/* Owns the keys equal to its id modulo the writer count: sets, overwrites and removes them */
+static void *writer(void *arg) {
+    worker_t *w = (worker_t *) arg;
+    unsigned k, v;
+    int round;
+    for (round = 0; round < NROUNDS; round++) {
+        for (k = w->id; k < NKEYS; k += NTHREADS / 2) {
+            v = VALUE(k, round);
+            if (!map_conc_set(w->m, &k, &v)) {
+                w->errors++;
+            }
+        }
+        for (k = w->id; k < NKEYS; k += NTHREADS / 2 * 3) {
+            if (round + 1 < NROUNDS && !map_conc_remove(w->m, &k)) {
+                w->errors++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *reader(void *arg) {
+    worker_t *w = (worker_t *) arg;
+    unsigned k, v;
+    int round;
+    for (round = 0; round < NROUNDS; round++) {
+        for (k = 0; k < NKEYS; k++) {
+            if (map_conc_get(w->m, &k, &v)) {
+                w->found++;
+                if (v % (NKEYS * 4u) != k) {
+                    w->errors++;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+int main(void) {
+    test_section("map_conc_init|map_conc_get|map_conc_set|map_conc_remove|map_conc_count") {
+        map_conc_u_u m;
+        unsigned k, v, ok;
+        test_assert(map_conc_stdinit(&m));
+        test_assert(m.base.hash_func == map_int_hash);
+        k = 1, v = 10;
+        test_assert(!map_conc_get(&m, &k, &v) && v == 10);
+        test_assert(map_conc_set(&m, &k, &v) && map_conc_count(&m) == 1);
+        v = 11;
+        test_assert(map_conc_set(&m, &k, &v) && map_conc_count(&m) == 1);
+        v = 0;
+        test_assert(map_conc_get(&m, &k, &v) && v == 11);
+        test_assert(map_conc_get(&m, &k, NULL));
+        test_assert(map_conc_remove(&m, &k) && !map_conc_remove(&m, &k) && map_conc_count(&m) == 0);
+        for (k = 0, ok = 1; k < 10000; k++) {
+            v = k * 3;
+            ok &= map_conc_set(&m, &k, &v);
+        }
+        test_assert(ok && map_conc_count(&m) == 10000);
+        for (k = 0, ok = 1; k < 10000; k++) {
+            ok &= map_conc_get(&m, &k, &v) && v == k * 3;
+        }
+        test_assert(ok);
+        map_conc_delete(&m);
+    }
+
+    test_section("map_conc stress") {
+        map_conc_u_u m;
+        pthread_t threads[NTHREADS];
+        worker_t workers[NTHREADS];
+        unsigned long errors = 0, found = 0;
+        unsigned i, k, v, ok;
+        test_assert(map_conc_stdinit(&m));
+        for (i = 0; i < NTHREADS; i++) {
+            workers[i].m = &m;
+            workers[i].id = i / 2;
+            workers[i].errors = 0;
+            workers[i].found = 0;
+            pthread_create(&threads[i], NULL, (i % 2) ? reader : writer, &workers[i]);
+        }
+        for (i = 0; i < NTHREADS; i++) {
+            pthread_join(threads[i], NULL);
+            errors += workers[i].errors;
+            found += workers[i].found;
+        }
+        test_assert(errors == 0 && found > 0);
+        test_assert(map_conc_count(&m) == NKEYS);
+        for (k = 0, ok = 1; k < NKEYS; k++) {
+            ok &= map_conc_get(&m, &k, &v) && v == VALUE(k, NROUNDS - 1);
+        }
+        test_assert(ok);
+        map_conc_delete(&m);
+    }
+
+    test_print_res();
+    return 0;
+}